@@ -0,0 +1,49 @@
+/// PixelIndex - Pixel coordinates packed as a single linear index
+///
+/// A pixel (u, v) of an image with the given width is stored as the
+/// linear index v*width + u, which halves the memory of PixelCoords.
+/// Row and column are only decoded when needed.
+///
+/// By default indices are 32-bit, enough for images with up to 2^32
+/// pixels. Compile with -DPIXEL_INDEX_64 for 64-bit indices.
+/// (The stack and queue sizes are size_t either way, but the fills
+/// return int counts, so a single fill must label fewer than 2^31 pixels.)
+///
+/// This module is part of a programming project for the course
+/// AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+///
+/// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+/// 2025
+
+#ifndef _PIXELINDEX_H_
+#define _PIXELINDEX_H_
+
+#include <inttypes.h>
+
+#ifdef PIXEL_INDEX_64
+typedef uint64_t PixelIndex;
+#define PIXEL_INDEX_MAX UINT64_MAX
+#else
+typedef uint32_t PixelIndex;
+#define PIXEL_INDEX_MAX UINT32_MAX
+#endif
+
+// These are used in the inner loops of the flood fills,
+// so they are defined here to be inlined.
+
+static inline PixelIndex PixelIndexCreate(uint32_t width, int u, int v) {
+  return (PixelIndex)v * width + (PixelIndex)u;
+}
+
+static inline int PixelIndexGetU(PixelIndex p, uint32_t width) {
+  return (int)(p % width);
+}
+
+static inline int PixelIndexGetV(PixelIndex p, uint32_t width) {
+  return (int)(p / width);
+}
+
+#endif  // _PIXELINDEX_H_
@@ -0,0 +1,169 @@
+/// PixelIndexQueue - A QUEUE ADT for storing packed pixel indices
+///
+/// This module is part of a programming project for the course
+/// AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+///
+/// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+/// 2025
+
+#include "PixelIndexQueue.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "PixelIndex.h"
+
+// The queue is a chain of fixed-size blocks.
+// Elements are added at the tail block and removed from the head block.
+// Emptied blocks are kept in a free list and reused, so growing the queue
+// never copies elements and memory follows the actual queue size.
+
+struct _Block {
+  struct _Block* next;               // next block in the chain (or list)
+  PixelIndex data[QUEUE_BLOCK_SIZE];  // the elements
+};
+
+struct _PixelIndexQueue {
+  size_t cur_size;           // current Queue size
+  struct _Block* head_block;  // block with the first element
+  uint32_t head;             // index of the first element in head_block
+  struct _Block* tail_block;  // block where elements are added
+  uint32_t tail;             // index of the next free slot in tail_block
+  struct _Block* free_list;   // emptied blocks, ready for reuse
+  uint32_t blocks;           // number of blocks in the chain
+  uint32_t peak_blocks;      // maximum number of blocks in the chain
+};
+
+// PRIVATE auxiliary functions
+
+// Get a block from the free list, or allocate a new one
+static struct _Block* get_block(IndexQueue* q) {
+  struct _Block* b = q->free_list;
+  if (b != NULL) {
+    q->free_list = b->next;
+  } else {
+    b = malloc(sizeof(struct _Block));
+    if (b == NULL) abort();
+  }
+  b->next = NULL;
+  return b;
+}
+
+// Return a block to the free list
+static void recycle_block(IndexQueue* q, struct _Block* b) {
+  b->next = q->free_list;
+  q->free_list = b;
+}
+
+static void free_chain(struct _Block* b) {
+  while (b != NULL) {
+    struct _Block* next = b->next;
+    free(b);
+    b = next;
+  }
+}
+
+// PUBLIC functions
+
+IndexQueue* IndexQueueCreate(size_t size) {
+  assert(size > 1);
+  IndexQueue* q = malloc(sizeof(IndexQueue));
+  if (q == NULL) abort();
+
+  q->cur_size = 0;
+  q->free_list = NULL;
+
+  // Pre-allocate the blocks for size elements (the head block included)
+  size_t nblocks = (size + QUEUE_BLOCK_SIZE - 1) / QUEUE_BLOCK_SIZE;
+  for (size_t i = 1; i < nblocks; i++) {
+    recycle_block(q, get_block(q));
+  }
+
+  q->head_block = q->tail_block = get_block(q);
+  q->head = q->tail = 0;
+  q->blocks = q->peak_blocks = 1;
+  return q;
+}
+
+void IndexQueueDestroy(IndexQueue** p) {
+  assert(*p != NULL);
+  IndexQueue* q = *p;
+  free_chain(q->head_block);
+  free_chain(q->free_list);
+  free(q);
+  *p = NULL;
+}
+
+void IndexQueueClear(IndexQueue* q) {
+  // Keep the head block, recycle the others
+  struct _Block* b = q->head_block->next;
+  while (b != NULL) {
+    struct _Block* next = b->next;
+    recycle_block(q, b);
+    b = next;
+  }
+  q->head_block->next = NULL;
+  q->tail_block = q->head_block;
+  q->head = q->tail = 0;
+  q->cur_size = 0;
+  q->blocks = 1;
+}
+
+size_t IndexQueueSize(const IndexQueue* q) { return q->cur_size; }
+
+// A block-chained queue is never full
+int IndexQueueIsFull(const IndexQueue* q) {
+  (void)q;
+  return 0;
+}
+
+int IndexQueueIsEmpty(const IndexQueue* q) { return (q->cur_size == 0); }
+
+PixelIndex IndexQueuePeek(const IndexQueue* q) {
+  assert(q->cur_size > 0);
+  return q->head_block->data[q->head];
+}
+
+void IndexQueueEnqueue(IndexQueue* q, PixelIndex p) {
+  // Is the tail block full?
+  if (q->tail == QUEUE_BLOCK_SIZE) {
+    struct _Block* b = get_block(q);
+    q->tail_block->next = b;
+    q->tail_block = b;
+    q->tail = 0;
+    q->blocks++;
+    if (q->blocks > q->peak_blocks) q->peak_blocks = q->blocks;
+  }
+
+  q->tail_block->data[q->tail++] = p;
+  q->cur_size++;
+}
+
+PixelIndex IndexQueueDequeue(IndexQueue* q) {
+  assert(q->cur_size > 0);
+  PixelIndex p = q->head_block->data[q->head++];
+  q->cur_size--;
+
+  if (q->cur_size == 0) {
+    // Empty: restart at the beginning of the head block
+    IndexQueueClear(q);
+  } else if (q->head == QUEUE_BLOCK_SIZE) {
+    // Head block consumed: move on to the next one
+    struct _Block* b = q->head_block;
+    q->head_block = b->next;
+    q->head = 0;
+    recycle_block(q, b);
+    q->blocks--;
+  }
+  return p;
+}
+
+uint32_t IndexQueueBlocks(const IndexQueue* q) { return q->blocks; }
+
+uint32_t IndexQueuePeakBlocks(const IndexQueue* q) { return q->peak_blocks; }
+
+void IndexQueueResetPeak(IndexQueue* q) { q->peak_blocks = q->blocks; }
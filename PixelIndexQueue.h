@@ -0,0 +1,55 @@
+/// PixelIndexQueue - A QUEUE ADT for storing packed pixel indices
+///
+/// This module is part of a programming project for the course
+/// AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+///
+/// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+/// 2025
+
+#ifndef _PIXELINDEX_QUEUE_
+#define _PIXELINDEX_QUEUE_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "PixelIndex.h"
+
+// The queue is stored as a chain of blocks of QUEUE_BLOCK_SIZE elements.
+// Emptied blocks are recycled, so the queue grows without copying and
+// its memory follows the actual number of elements.
+#define QUEUE_BLOCK_SIZE 1024
+
+typedef struct _PixelIndexQueue IndexQueue;
+
+// size: the expected number of elements (blocks for them are
+// pre-allocated; the queue grows beyond it if needed).
+IndexQueue* IndexQueueCreate(size_t size);
+
+void IndexQueueDestroy(IndexQueue** p);
+
+void IndexQueueClear(IndexQueue* q);
+
+size_t IndexQueueSize(const IndexQueue* q);
+
+int IndexQueueIsFull(const IndexQueue* q);
+
+int IndexQueueIsEmpty(const IndexQueue* q);
+
+PixelIndex IndexQueuePeek(const IndexQueue* q);
+
+void IndexQueueEnqueue(IndexQueue* q, PixelIndex p);
+
+PixelIndex IndexQueueDequeue(IndexQueue* q);
+
+// Block usage, for sizing: current and peak number of blocks in use.
+uint32_t IndexQueueBlocks(const IndexQueue* q);
+
+uint32_t IndexQueuePeakBlocks(const IndexQueue* q);
+
+// Restart the peak count from the current number of blocks.
+void IndexQueueResetPeak(IndexQueue* q);
+
+#endif  // _PIXELINDEX_QUEUE_
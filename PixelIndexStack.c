@@ -0,0 +1,86 @@
+/// PixelIndexStack - A STACK ADT for storing packed pixel indices
+///
+/// This module is part of a programming project for the course
+/// AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+///
+/// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+/// 2025
+
+#include "PixelIndexStack.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "PixelIndex.h"
+
+struct _PixelIndexStack {
+  size_t max_size;   // maximum stack size
+  size_t cur_size;   // current stack size
+  PixelIndex* data;   // the stack data (stored in an array)
+};
+
+IndexStack* IndexStackCreate(size_t size) {
+  assert(size > 1);
+  IndexStack* s = malloc(sizeof(IndexStack));
+  if (s == NULL) abort();
+
+  s->max_size = size;
+  s->cur_size = 0;
+
+  s->data = malloc(size * sizeof(PixelIndex));
+  if (s->data == NULL) {
+    free(s);
+    abort();
+  }
+  return s;
+}
+
+void IndexStackDestroy(IndexStack** p) {
+  assert(*p != NULL);
+  IndexStack* s = *p;
+  free(s->data);
+  free(s);
+  *p = NULL;
+}
+
+void IndexStackClear(IndexStack* s) { s->cur_size = 0; }
+
+size_t IndexStackSize(const IndexStack* s) { return s->cur_size; }
+
+int IndexStackIsFull(const IndexStack* s) {
+  return (s->cur_size == s->max_size);
+}
+
+int IndexStackIsEmpty(const IndexStack* s) { return (s->cur_size == 0); }
+
+PixelIndex IndexStackPeek(const IndexStack* s) {
+  assert(s->cur_size > 0);
+  return s->data[s->cur_size - 1];
+}
+
+void IndexStackPush(IndexStack* s, PixelIndex p) {
+  assert(s->cur_size <= s->max_size);
+
+  // Is the stack full?
+  if (s->cur_size == s->max_size) {
+    s->max_size *= 2;
+    PixelIndex* data = realloc(s->data, s->max_size * sizeof(PixelIndex));
+    if (data == NULL) {
+      free(s->data);
+      free(s);
+      abort();
+    }
+    s->data = data;
+  }
+
+  s->data[s->cur_size++] = p;
+}
+
+PixelIndex IndexStackPop(IndexStack* s) {
+  assert(s->cur_size > 0);
+  return s->data[--(s->cur_size)];
+}
@@ -0,0 +1,40 @@
+/// PixelIndexStack - A STACK ADT for storing packed pixel indices
+///
+/// This module is part of a programming project for the course
+/// AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+///
+/// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+/// 2025
+
+#ifndef _PIXELINDEX_STACK_
+#define _PIXELINDEX_STACK_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "PixelIndex.h"
+
+typedef struct _PixelIndexStack IndexStack;
+
+IndexStack* IndexStackCreate(size_t size);
+
+void IndexStackDestroy(IndexStack** p);
+
+void IndexStackClear(IndexStack* s);
+
+size_t IndexStackSize(const IndexStack* s);
+
+int IndexStackIsFull(const IndexStack* s);
+
+int IndexStackIsEmpty(const IndexStack* s);
+
+PixelIndex IndexStackPeek(const IndexStack* s);
+
+void IndexStackPush(IndexStack* s, PixelIndex p);
+
+PixelIndex IndexStackPop(IndexStack* s);
+
+#endif  // _PIXELINDEX_STACK_
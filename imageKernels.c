@@ -0,0 +1,512 @@
+/// imageKernels - Row kernels of the image module, with runtime dispatch
+///
+/// This module is part of a programming project for the course
+/// AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+///
+/// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+/// 2025
+
+#include "imageKernels.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// The SIMD levels are compiled with per-function target attributes,
+// so the rest of the program keeps the baseline instruction set.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86 1
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define KERNELS_X86 0
+#endif
+
+// The scalar level compares four labels per 64-bit word (SWAR)
+// where the byte order allows it.
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SWAR_RUNS 1
+#else
+#define SWAR_RUNS 0
+#endif
+
+/// Scalar kernels
+
+static uint32_t RunEndScalar(const uint16_t* row, uint32_t from, uint32_t to,
+                             uint16_t value) {
+  uint32_t i = from;
+#if SWAR_RUNS
+  uint64_t pattern = value * 0x0001000100010001ull;
+  for (; i + 4 <= to; i += 4) {
+    uint64_t word;
+    memcpy(&word, row + i, sizeof(word));
+    uint64_t diff = word ^ pattern;
+    if (diff != 0) return i + (uint32_t)__builtin_ctzll(diff) / 16;
+  }
+#endif
+  while (i < to && row[i] == value) i++;
+  return i;
+}
+
+static uint32_t FindScalar(const uint16_t* row, uint32_t from, uint32_t to,
+                           uint16_t value) {
+  uint32_t i = from;
+#if SWAR_RUNS
+  uint64_t pattern = value * 0x0001000100010001ull;
+  for (; i + 4 <= to; i += 4) {
+    uint64_t word;
+    memcpy(&word, row + i, sizeof(word));
+    uint64_t diff = word ^ pattern;
+    // The lowest zero lane of diff is flagged exactly (higher ones may not be)
+    uint64_t zero = (diff - 0x0001000100010001ull) & ~diff &
+                    0x8000800080008000ull;
+    if (zero != 0) return i + (uint32_t)__builtin_ctzll(zero) / 16;
+  }
+#endif
+  while (i < to && row[i] != value) i++;
+  return i;
+}
+
+static void RemapScalar(uint16_t* row, uint32_t n, const uint16_t* map) {
+  for (uint32_t j = 0; j < n; j++) {
+    row[j] = map[row[j]];
+  }
+}
+
+// Pack the pixels [x0, n) into words starting at bits[x0 / 64].
+// Requires: x0 % 64 == 0.
+static void PackTail(const uint16_t* row, uint32_t x0, uint32_t n,
+                     uint16_t value, uint64_t* bits) {
+  for (; x0 < n; x0 += 64) {
+    uint32_t x1 = x0 + 64 < n ? x0 + 64 : n;
+    uint64_t word = 0;
+    for (uint32_t x = x0; x < x1; x++) {
+      word |= (uint64_t)(row[x] == value) << (x - x0);
+    }
+    bits[x0 / 64] = word;
+  }
+}
+
+static void PackScalar(const uint16_t* row, uint32_t n, uint16_t value,
+                       uint64_t* bits) {
+  PackTail(row, 0, n, value, bits);
+}
+
+// Unpack the pixels [x0, n).
+static void UnpackTail(uint16_t* row, uint32_t x0, uint32_t n,
+                       const uint64_t* bits, uint16_t set, uint16_t clear) {
+  for (uint32_t x = x0; x < n; x++) {
+    if ((bits[x / 64] >> (x % 64)) & 1) {
+      row[x] = set;
+    } else if (row[x] == set) {
+      row[x] = clear;
+    }
+  }
+}
+
+static void UnpackScalar(uint16_t* row, uint32_t n, const uint64_t* bits,
+                         uint16_t set, uint16_t clear) {
+  UnpackTail(row, 0, n, bits, set, clear);
+}
+
+// Transpose the block of rows [i0, i1) and columns [j0, j1) of src.
+static void TransposeRange(uint16_t* const* dst, const uint16_t* const* src,
+                           uint32_t i0, uint32_t i1, uint32_t j0,
+                           uint32_t j1) {
+  for (uint32_t j = j0; j < j1; j++) {
+    for (uint32_t i = i0; i < i1; i++) {
+      dst[j][i] = src[i][j];
+    }
+  }
+}
+
+// Transpose in 8x8 tiles, so the rows of src and dst touched by a tile
+// stay in cache.
+static void TransposeScalar(uint16_t* const* dst, const uint16_t* const* src,
+                            uint32_t rows, uint32_t cols) {
+  for (uint32_t i0 = 0; i0 < rows; i0 += 8) {
+    uint32_t i1 = i0 + 8 < rows ? i0 + 8 : rows;
+    for (uint32_t j0 = 0; j0 < cols; j0 += 8) {
+      uint32_t j1 = j0 + 8 < cols ? j0 + 8 : cols;
+      TransposeRange(dst, src, i0, i1, j0, j1);
+    }
+  }
+}
+
+// Count 4 consecutive labels, one per sub-histogram.
+static inline void Count4(const uint16_t* p, uint32_t* const sub[4]) {
+  sub[0][p[0]]++;
+  sub[1][p[1]]++;
+  sub[2][p[2]]++;
+  sub[3][p[3]]++;
+}
+
+static void HistogramScalar(const uint16_t* row, uint32_t n,
+                            uint32_t* const sub[4]) {
+  uint32_t j = 0;
+  for (; j + 4 <= n; j += 4) {
+    Count4(row + j, sub);
+  }
+  for (; j < n; j++) {
+    sub[0][row[j]]++;
+  }
+}
+
+static const ImageKernels scalar_kernels = {
+    "scalar",        KERNELS_SCALAR, RunEndScalar,    FindScalar,
+    RemapScalar,     PackScalar,     UnpackScalar,    TransposeScalar,
+    HistogramScalar,
+};
+
+#if KERNELS_X86
+
+/// SSE2 kernels (8 labels per vector)
+
+TARGET_SSE2
+static uint32_t RunEndSSE2(const uint16_t* row, uint32_t from, uint32_t to,
+                           uint16_t value) {
+  __m128i pattern = _mm_set1_epi16((short)value);
+  uint32_t i = from;
+  for (; i + 8 <= to; i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+    uint32_t eq = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi16(x, pattern));
+    if (eq != 0xffff) return i + (uint32_t)__builtin_ctz(~eq) / 2;
+  }
+  while (i < to && row[i] == value) i++;
+  return i;
+}
+
+TARGET_SSE2
+static uint32_t FindSSE2(const uint16_t* row, uint32_t from, uint32_t to,
+                         uint16_t value) {
+  __m128i pattern = _mm_set1_epi16((short)value);
+  uint32_t i = from;
+  for (; i + 8 <= to; i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+    uint32_t eq = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi16(x, pattern));
+    if (eq != 0) return i + (uint32_t)__builtin_ctz(eq) / 2;
+  }
+  while (i < to && row[i] != value) i++;
+  return i;
+}
+
+TARGET_SSE2
+static void PackSSE2(const uint16_t* row, uint32_t n, uint16_t value,
+                     uint64_t* bits) {
+  __m128i pattern = _mm_set1_epi16((short)value);
+  uint32_t x0 = 0;
+  for (; x0 + 64 <= n; x0 += 64) {
+    uint64_t word = 0;
+    for (uint32_t t = 0; t < 64; t += 16) {
+      __m128i a = _mm_loadu_si128((const __m128i*)(row + x0 + t));
+      __m128i b = _mm_loadu_si128((const __m128i*)(row + x0 + t + 8));
+      __m128i eq = _mm_packs_epi16(_mm_cmpeq_epi16(a, pattern),
+                                   _mm_cmpeq_epi16(b, pattern));
+      word |= (uint64_t)(uint32_t)_mm_movemask_epi8(eq) << t;
+    }
+    bits[x0 / 64] = word;
+  }
+  PackTail(row, x0, n, value, bits);
+}
+
+TARGET_SSE2
+static void UnpackSSE2(uint16_t* row, uint32_t n, const uint64_t* bits,
+                       uint16_t set, uint16_t clear) {
+  const __m128i powers = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+  __m128i vset = _mm_set1_epi16((short)set);
+  __m128i vclear = _mm_set1_epi16((short)clear);
+  uint32_t x = 0;
+  for (; x + 8 <= n; x += 8) {
+    uint32_t byte = (uint32_t)(bits[x / 64] >> (x % 64)) & 0xff;
+    __m128i on = _mm_and_si128(_mm_set1_epi16((short)byte), powers);
+    on = _mm_cmpeq_epi16(on, powers);
+    __m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+    __m128i was = _mm_cmpeq_epi16(v, vset);
+    v = _mm_or_si128(_mm_and_si128(was, vclear), _mm_andnot_si128(was, v));
+    v = _mm_or_si128(_mm_and_si128(on, vset), _mm_andnot_si128(on, v));
+    _mm_storeu_si128((__m128i*)(row + x), v);
+  }
+  UnpackTail(row, x, n, bits, set, clear);
+}
+
+// Transpose the 8x8 block at rows i0 and columns j0 of src.
+TARGET_SSE2
+static void Transpose8x8SSE2(uint16_t* const* dst, const uint16_t* const* src,
+                             uint32_t i0, uint32_t j0) {
+  __m128i a[8], t[8], u[8];
+  for (int k = 0; k < 8; k++) {
+    a[k] = _mm_loadu_si128((const __m128i*)(src[i0 + k] + j0));
+  }
+  for (int k = 0; k < 4; k++) {
+    t[2 * k] = _mm_unpacklo_epi16(a[2 * k], a[2 * k + 1]);
+    t[2 * k + 1] = _mm_unpackhi_epi16(a[2 * k], a[2 * k + 1]);
+  }
+  for (int k = 0; k < 2; k++) {
+    u[4 * k] = _mm_unpacklo_epi32(t[4 * k], t[4 * k + 2]);
+    u[4 * k + 1] = _mm_unpackhi_epi32(t[4 * k], t[4 * k + 2]);
+    u[4 * k + 2] = _mm_unpacklo_epi32(t[4 * k + 1], t[4 * k + 3]);
+    u[4 * k + 3] = _mm_unpackhi_epi32(t[4 * k + 1], t[4 * k + 3]);
+  }
+  // u[c / 2] holds columns c and c + 1 of rows 0..3, u[4 + c / 2] of rows 4..7
+  for (int c = 0; c < 8; c += 2) {
+    __m128i lo = _mm_unpacklo_epi64(u[c / 2], u[4 + c / 2]);
+    __m128i hi = _mm_unpackhi_epi64(u[c / 2], u[4 + c / 2]);
+    _mm_storeu_si128((__m128i*)(dst[j0 + c] + i0), lo);
+    _mm_storeu_si128((__m128i*)(dst[j0 + c + 1] + i0), hi);
+  }
+}
+
+TARGET_SSE2
+static void TransposeSSE2(uint16_t* const* dst, const uint16_t* const* src,
+                          uint32_t rows, uint32_t cols) {
+  uint32_t rows8 = rows & ~7u;
+  uint32_t cols8 = cols & ~7u;
+  for (uint32_t i0 = 0; i0 < rows8; i0 += 8) {
+    for (uint32_t j0 = 0; j0 < cols8; j0 += 8) {
+      Transpose8x8SSE2(dst, src, i0, j0);
+    }
+  }
+  TransposeRange(dst, src, 0, rows8, cols8, cols);
+  TransposeRange(dst, src, rows8, rows, 0, cols);
+}
+
+// Runs of 8 equal labels are counted with a single add.
+TARGET_SSE2
+static void HistogramSSE2(const uint16_t* row, uint32_t n,
+                          uint32_t* const sub[4]) {
+  uint32_t j = 0;
+  for (; j + 8 <= n; j += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(row + j));
+    __m128i first = _mm_set1_epi16((short)row[j]);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(x, first)) == 0xffff) {
+      sub[0][row[j]] += 8;
+    } else {
+      Count4(row + j, sub);
+      Count4(row + j + 4, sub);
+    }
+  }
+  for (; j < n; j++) {
+    sub[0][row[j]]++;
+  }
+}
+
+// SSE2 has no gather, so the remap is the scalar loop.
+static const ImageKernels sse2_kernels = {
+    "sse2",        KERNELS_SSE2, RunEndSSE2,    FindSSE2,
+    RemapScalar,   PackSSE2,     UnpackSSE2,    TransposeSSE2,
+    HistogramSSE2,
+};
+
+/// AVX2 kernels (16 labels per vector)
+
+TARGET_AVX2
+static uint32_t RunEndAVX2(const uint16_t* row, uint32_t from, uint32_t to,
+                           uint16_t value) {
+  __m256i pattern = _mm256_set1_epi16((short)value);
+  uint32_t i = from;
+  for (; i + 16 <= to; i += 16) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(row + i));
+    uint32_t eq =
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi16(x, pattern));
+    if (eq != 0xffffffffu) return i + (uint32_t)__builtin_ctz(~eq) / 2;
+  }
+  while (i < to && row[i] == value) i++;
+  return i;
+}
+
+TARGET_AVX2
+static uint32_t FindAVX2(const uint16_t* row, uint32_t from, uint32_t to,
+                         uint16_t value) {
+  __m256i pattern = _mm256_set1_epi16((short)value);
+  uint32_t i = from;
+  for (; i + 16 <= to; i += 16) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(row + i));
+    uint32_t eq =
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi16(x, pattern));
+    if (eq != 0) return i + (uint32_t)__builtin_ctz(eq) / 2;
+  }
+  while (i < to && row[i] != value) i++;
+  return i;
+}
+
+// The labels are widened to 32 bits and gathered as 32-bit words, whose
+// high half (the next map entry) is dropped.
+TARGET_AVX2
+static void RemapAVX2(uint16_t* row, uint32_t n, const uint16_t* map) {
+  const __m256i low = _mm256_set1_epi32(0xffff);
+  uint32_t j = 0;
+  for (; j + 16 <= n; j += 16) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(row + j));
+    __m256i lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(x));
+    __m256i hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(x, 1));
+    lo = _mm256_and_si256(_mm256_i32gather_epi32((const int*)map, lo, 2), low);
+    hi = _mm256_and_si256(_mm256_i32gather_epi32((const int*)map, hi, 2), low);
+    // packus interleaves the 128-bit lanes of lo and hi
+    x = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xd8);
+    _mm256_storeu_si256((__m256i*)(row + j), x);
+  }
+  RemapScalar(row + j, n - j, map);
+}
+
+TARGET_AVX2
+static void PackAVX2(const uint16_t* row, uint32_t n, uint16_t value,
+                     uint64_t* bits) {
+  __m256i pattern = _mm256_set1_epi16((short)value);
+  uint32_t x0 = 0;
+  for (; x0 + 64 <= n; x0 += 64) {
+    uint64_t word = 0;
+    for (uint32_t t = 0; t < 64; t += 32) {
+      __m256i a = _mm256_loadu_si256((const __m256i*)(row + x0 + t));
+      __m256i b = _mm256_loadu_si256((const __m256i*)(row + x0 + t + 16));
+      __m256i eq = _mm256_packs_epi16(_mm256_cmpeq_epi16(a, pattern),
+                                      _mm256_cmpeq_epi16(b, pattern));
+      eq = _mm256_permute4x64_epi64(eq, 0xd8);
+      word |= (uint64_t)(uint32_t)_mm256_movemask_epi8(eq) << t;
+    }
+    bits[x0 / 64] = word;
+  }
+  PackTail(row, x0, n, value, bits);
+}
+
+TARGET_AVX2
+static void UnpackAVX2(uint16_t* row, uint32_t n, const uint64_t* bits,
+                       uint16_t set, uint16_t clear) {
+  const __m256i powers = _mm256_setr_epi16(
+      1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384,
+      (short)0x8000);
+  __m256i vset = _mm256_set1_epi16((short)set);
+  __m256i vclear = _mm256_set1_epi16((short)clear);
+  uint32_t x = 0;
+  for (; x + 16 <= n; x += 16) {
+    uint32_t half = (uint32_t)(bits[x / 64] >> (x % 64)) & 0xffff;
+    __m256i on = _mm256_and_si256(_mm256_set1_epi16((short)half), powers);
+    on = _mm256_cmpeq_epi16(on, powers);
+    __m256i v = _mm256_loadu_si256((const __m256i*)(row + x));
+    __m256i was = _mm256_cmpeq_epi16(v, vset);
+    v = _mm256_blendv_epi8(v, vclear, was);
+    v = _mm256_blendv_epi8(v, vset, on);
+    _mm256_storeu_si256((__m256i*)(row + x), v);
+  }
+  UnpackTail(row, x, n, bits, set, clear);
+}
+
+// Transpose the 8x16 block at rows i0 and columns j0 of src: each 128-bit
+// lane goes through the 8x8 network of Transpose8x8SSE2 independently.
+TARGET_AVX2
+static void Transpose8x16AVX2(uint16_t* const* dst, const uint16_t* const* src,
+                              uint32_t i0, uint32_t j0) {
+  __m256i a[8], t[8], u[8];
+  for (int k = 0; k < 8; k++) {
+    a[k] = _mm256_loadu_si256((const __m256i*)(src[i0 + k] + j0));
+  }
+  for (int k = 0; k < 4; k++) {
+    t[2 * k] = _mm256_unpacklo_epi16(a[2 * k], a[2 * k + 1]);
+    t[2 * k + 1] = _mm256_unpackhi_epi16(a[2 * k], a[2 * k + 1]);
+  }
+  for (int k = 0; k < 2; k++) {
+    u[4 * k] = _mm256_unpacklo_epi32(t[4 * k], t[4 * k + 2]);
+    u[4 * k + 1] = _mm256_unpackhi_epi32(t[4 * k], t[4 * k + 2]);
+    u[4 * k + 2] = _mm256_unpacklo_epi32(t[4 * k + 1], t[4 * k + 3]);
+    u[4 * k + 3] = _mm256_unpackhi_epi32(t[4 * k + 1], t[4 * k + 3]);
+  }
+  for (int c = 0; c < 8; c += 2) {
+    __m256i lo = _mm256_unpacklo_epi64(u[c / 2], u[4 + c / 2]);
+    __m256i hi = _mm256_unpackhi_epi64(u[c / 2], u[4 + c / 2]);
+    _mm_storeu_si128((__m128i*)(dst[j0 + c] + i0),
+                     _mm256_castsi256_si128(lo));
+    _mm_storeu_si128((__m128i*)(dst[j0 + c + 1] + i0),
+                     _mm256_castsi256_si128(hi));
+    _mm_storeu_si128((__m128i*)(dst[j0 + 8 + c] + i0),
+                     _mm256_extracti128_si256(lo, 1));
+    _mm_storeu_si128((__m128i*)(dst[j0 + 8 + c + 1] + i0),
+                     _mm256_extracti128_si256(hi, 1));
+  }
+}
+
+TARGET_AVX2
+static void TransposeAVX2(uint16_t* const* dst, const uint16_t* const* src,
+                          uint32_t rows, uint32_t cols) {
+  uint32_t rows8 = rows & ~7u;
+  uint32_t cols16 = cols & ~15u;
+  uint32_t cols8 = cols & ~7u;
+  for (uint32_t i0 = 0; i0 < rows8; i0 += 8) {
+    for (uint32_t j0 = 0; j0 < cols16; j0 += 16) {
+      Transpose8x16AVX2(dst, src, i0, j0);
+    }
+    if (cols8 > cols16) Transpose8x8SSE2(dst, src, i0, cols16);
+  }
+  TransposeRange(dst, src, 0, rows8, cols8, cols);
+  TransposeRange(dst, src, rows8, rows, 0, cols);
+}
+
+// Runs of 16 equal labels are counted with a single add.
+TARGET_AVX2
+static void HistogramAVX2(const uint16_t* row, uint32_t n,
+                          uint32_t* const sub[4]) {
+  uint32_t j = 0;
+  for (; j + 16 <= n; j += 16) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(row + j));
+    __m256i first = _mm256_set1_epi16((short)row[j]);
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi16(x, first)) == -1) {
+      sub[0][row[j]] += 16;
+    } else {
+      for (uint32_t k = 0; k < 16; k += 4) Count4(row + j + k, sub);
+    }
+  }
+  for (; j < n; j++) {
+    sub[0][row[j]]++;
+  }
+}
+
+static const ImageKernels avx2_kernels = {
+    "avx2",        KERNELS_AVX2, RunEndAVX2,    FindAVX2,
+    RemapAVX2,     PackAVX2,     UnpackAVX2,    TransposeAVX2,
+    HistogramAVX2,
+};
+
+#endif  // KERNELS_X86
+
+/// Dispatch
+
+const ImageKernels* Kernels = &scalar_kernels;
+
+int KernelsDetect(void) {
+#if KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return KERNELS_AVX2;
+  if (__builtin_cpu_supports("sse2")) return KERNELS_SSE2;
+#endif
+  return KERNELS_SCALAR;
+}
+
+const ImageKernels* KernelsGet(int level) {
+  if (level > KernelsDetect()) return NULL;
+  switch (level) {
+    case KERNELS_SCALAR:
+      return &scalar_kernels;
+#if KERNELS_X86
+    case KERNELS_SSE2:
+      return &sse2_kernels;
+    case KERNELS_AVX2:
+      return &avx2_kernels;
+#endif
+  }
+  return NULL;
+}
+
+int KernelsInit(void) {
+  int level = KernelsDetect();
+  const char* force = getenv("IMAGERGB_SIMD");
+  if (force != NULL) {
+    for (int l = KERNELS_SCALAR; l <= level; l++) {
+      const ImageKernels* k = KernelsGet(l);
+      if (k != NULL && strcmp(force, k->name) == 0) level = l;
+    }
+  }
+  Kernels = KernelsGet(level);
+  return level;
+}
@@ -0,0 +1,82 @@
+/// imageKernels - Row kernels of the image module, with runtime dispatch
+///
+/// The hot loops of imageRGB (row compare, label remap, bit pack/unpack,
+/// transpose and histogram) have one implementation per instruction set
+/// level. The best level supported by the CPU is selected once, by
+/// KernelsInit (called by ImageInit), and used through function pointers,
+/// so a single binary built without -march flags runs everywhere.
+///
+/// The environment variable IMAGERGB_SIMD (scalar, sse2 or avx2) forces a
+/// lower level, e.g. for testing. A level above the detected one is not
+/// honored.
+///
+/// This module is part of a programming project for the course
+/// AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+///
+/// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+/// 2025
+
+#ifndef _IMAGE_KERNELS_
+#define _IMAGE_KERNELS_
+
+#include <inttypes.h>
+
+/// Instruction set levels
+#define KERNELS_SCALAR 0
+#define KERNELS_SSE2 1
+#define KERNELS_AVX2 2
+
+/// A set of kernels of one level.
+/// All levels produce identical results.
+typedef struct {
+  const char* name;
+  int level;
+
+  /// First index i in [from, to) with row[i] != value, or to.
+  uint32_t (*run_end)(const uint16_t* row, uint32_t from, uint32_t to,
+                      uint16_t value);
+
+  /// First index i in [from, to) with row[i] == value, or to.
+  uint32_t (*find)(const uint16_t* row, uint32_t from, uint32_t to,
+                   uint16_t value);
+
+  /// row[j] = map[row[j]] for j in [0, n).
+  /// map must have one entry past the largest label in row.
+  void (*remap)(uint16_t* row, uint32_t n, const uint16_t* map);
+
+  /// Bit j of bits (64 per word) = (row[j] == value), for j in [0, n).
+  /// The unused bits of the last word are cleared.
+  void (*pack)(const uint16_t* row, uint32_t n, uint16_t value,
+               uint64_t* bits);
+
+  /// For j in [0, n): if bit j of bits is set, row[j] = set;
+  /// otherwise, if row[j] == set, row[j] = clear.
+  void (*unpack)(uint16_t* row, uint32_t n, const uint64_t* bits,
+                 uint16_t set, uint16_t clear);
+
+  /// dst[j][i] = src[i][j] for i in [0, rows) and j in [0, cols).
+  void (*transpose)(uint16_t* const* dst, const uint16_t* const* src,
+                    uint32_t rows, uint32_t cols);
+
+  /// Add the labels of row to the counts, spread over four
+  /// sub-histograms (their sum is the histogram of the row).
+  void (*histogram)(const uint16_t* row, uint32_t n, uint32_t* const sub[4]);
+} ImageKernels;
+
+/// The selected kernels (scalar until KernelsInit is called).
+extern const ImageKernels* Kernels;
+
+/// Detect the CPU features and select the kernels, honoring IMAGERGB_SIMD.
+/// Returns the selected level.
+int KernelsInit(void);
+
+/// Highest level supported by the CPU.
+int KernelsDetect(void);
+
+/// Kernels of a given level, or NULL if the CPU does not support it.
+const ImageKernels* KernelsGet(int level);
+
+#endif  // _IMAGE_KERNELS_
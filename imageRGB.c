@@ -27,11 +27,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-#include "PixelCoords.h"
-#include "PixelCoordsQueue.h"
-#include "PixelCoordsStack.h"
+#include "PixelIndex.h"
+#include "PixelIndexQueue.h"
+#include "PixelIndexStack.h"
+#include "imageKernels.h"
 #include "instrumentation.h"
+#include "threadPool.h"
 
 // The data structure
 //
@@ -88,19 +91,85 @@ static void check(int condition, const char* failmsg) {
   }
 }
 
+// Macros to simplify accessing instrumentation counters:
+#define PIXMEM InstrCount[0]
+#define PUSHES InstrCount[1]
+// Add more macros here...
+
+// TIP: Search for PIXMEM or InstrCount to see where it is incremented!
+
+/// Parallel execution
+
+// Number of threads used by the parallel operations (0 = one per CPU).
+static int num_threads = 0;
+
+/// Get the number of threads used by parallel operations.
+int ImageThreads(void) {
+  if (num_threads > 0) return num_threads;
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return ncpus > 0 ? (int)ncpus : 1;
+}
+
+// Is the thread pool started? (By ImageInit, until ImageShutdown.)
+static int pool_started = 0;
+
+// Start (or restart) the pool, with the calling thread as one of the
+// ImageThreads() threads.
+// (InstrPrint reports the cpu utilization over these threads.)
+static void StartPool(void) {
+  PoolInit(ImageThreads() - 1);
+  pool_started = 1;
+  InstrThreads = ImageThreads();
+}
+
+/// Set the number of threads used by parallel operations.
+void ImageSetThreads(int n) {
+  assert(n >= 0);
+  num_threads = n;
+  InstrThreads = ImageThreads();
+  if (pool_started) StartPool();
+}
+
+// Number of bands to split n items into, so that each band gets at least
+// min_band items and no more bands than threads are used.
+static int NumBands(uint64_t n, uint64_t min_band) {
+  uint64_t nbands = n / (min_band > 0 ? min_band : 1);
+  uint64_t nthreads = (uint64_t)ImageThreads();
+  if (nbands > nthreads) nbands = nthreads;
+  return nbands > 0 ? (int)nbands : 1;
+}
+
+// First item of band b, when splitting n items into nbands bands.
+static uint32 BandStart(uint32 n, int nbands, int b) {
+  return (uint32)((uint64_t)n * (uint64_t)b / (uint64_t)nbands);
+}
+
+// Run fn(arg, 0), ..., fn(arg, ntasks-1) on the thread pool and wait for
+// all. Task 0 runs on the calling thread.
+// Tasks may update the instrumentation counters (each thread has its own
+// block), but counting in locals and adding after the run is cheaper.
+static void ParallelRun(int ntasks, TaskFunction fn, void* arg) {
+  assert(ntasks > 0);
+  PoolRun(ntasks, fn, arg);
+}
+
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Set names of counters, select the row kernels for this CPU and start
+/// the thread pool. (Instrumentation is calibrated when first needed.)
 void ImageInit(void) {  ///
-  InstrCalibrate();
+  KernelsInit();
+  StartPool();
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
+  InstrName[1] = "pushes";  // InstrCount[1] will count pending fill pixels
   // Name other counters here...
 }
 
-// Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
-// Add more macros here...
-
-// TIP: Search for PIXMEM or InstrCount to see where it is incremented!
+/// Stop the thread pool started by ImageInit.
+/// Parallel operations run serially afterwards, until ImageInit.
+void ImageShutdown(void) {  ///
+  PoolShutdown();
+  pool_started = 0;
+}
 
 /// Auxiliary (static) functions
 
@@ -122,7 +191,8 @@ static Image AllocateImageHeader(uint32 width, uint32 height) {
   check(newHeader->image != NULL, "Alloc failed ->image array");
 
   // Allocating the LUT
-  newHeader->LUT = malloc(FIXED_LUT_SIZE * sizeof(rgb_t));
+  // (zeroed, so that unused entries compare equal across images)
+  newHeader->LUT = calloc(FIXED_LUT_SIZE, sizeof(rgb_t));
   // Error handling
   check(newHeader->LUT != NULL, "Alloc failed ->LUT array");
 
@@ -564,6 +634,182 @@ uint16 ImageColors(const Image img) {
   return img->num_colors;
 }
 
+/// LUT maintenance
+
+// Mark in used[] the labels present in a row of pixels.
+// (Only stores, so there is no load-to-store dependency between pixels.)
+static void LabelUsage(const uint16* row, uint32 n, uint8 used[]) {
+  for (uint32 j = 0; j < n; j++) {
+    used[row[j]] = 1;
+  }
+}
+
+/// Compact the LUT of img.
+/// Returns the new number of colors.
+uint16 ImageCompactLUT(Image img) {
+  assert(img != NULL);
+
+  // Which labels are in use?
+  uint8 used[FIXED_LUT_SIZE] = {0};
+  used[WHITE] = 1;
+  used[BLACK] = 1;
+  for (uint32 i = 0; i < img->height; i++) {
+    LabelUsage(img->image[i], img->width, used);
+  }
+  PIXMEM += (unsigned long)img->width * img->height;
+
+  // Build the new LUT in place, merging duplicate colors
+  uint16 map[FIXED_LUT_SIZE + 1] = {0};  // one entry past, for the kernels
+  uint16 n = 0;
+  int identity = 1;
+  for (uint16 label = 0; label < FIXED_LUT_SIZE; label++) {
+    map[label] = label;
+    if (!used[label]) continue;
+    rgb_t color = img->LUT[label];
+    uint16 k = 0;
+    while (k < n && img->LUT[k] != color) k++;
+    if (k == n) {
+      img->LUT[n++] = color;  // k <= label, so nothing is overwritten
+    }
+    map[label] = k;
+    identity = identity && (k == label);
+  }
+
+  // Keep unused entries zeroed
+  for (uint16 k = n; k < FIXED_LUT_SIZE; k++) {
+    img->LUT[k] = 0;
+  }
+  img->num_colors = n;
+
+  // Remap the pixels (not needed if no label changed)
+  if (!identity) {
+    for (uint32 i = 0; i < img->height; i++) {
+      Kernels->remap(img->image[i], img->width, map);
+    }
+    PIXMEM += (unsigned long)img->width * img->height;
+  }
+
+  return n;
+}
+
+/// Label statistics
+
+// Minimum number of pixels per band of the parallel histogram
+#define HISTOGRAM_MIN_BAND (1 << 15)
+
+// Work of one band of rows of ImageLabelHistogram
+struct histogramBand {
+  uint32 v0, v1;                  // rows [v0, v1)
+  uint32 counts[FIXED_LUT_SIZE];  // pixels per label
+  LabelBox* boxes;                // bounding boxes per label (or NULL)
+};
+
+struct histogramJob {
+  Image img;
+  struct histogramBand* bands;
+};
+
+// Count the labels of a band of rows.
+// Four private sub-histograms are used for consecutive pixels, so runs of
+// equal labels do not serialize on the same counter (store-to-load stalls).
+// With boxes, each row is walked by runs of equal labels instead, which
+// gives the counts and the boxes in the same pass.
+static void HistogramBand(void* arg, int b) {
+  struct histogramJob* job = arg;
+  struct histogramBand* band = &job->bands[b];
+  Image img = job->img;
+  uint32 w = img->width;
+
+  if (band->boxes != NULL) {
+    LabelBox* boxes = band->boxes;
+    for (uint32 k = 0; k < FIXED_LUT_SIZE; k++) {
+      band->counts[k] = 0;
+      boxes[k].umin = boxes[k].vmin = UINT32_MAX;
+      boxes[k].umax = boxes[k].vmax = 0;
+    }
+    for (uint32 i = band->v0; i < band->v1; i++) {
+      const uint16* row = img->image[i];
+      for (uint32 j = 0; j < w;) {
+        uint16 label = row[j];
+        uint32 end = Kernels->run_end(row, j, w, label);
+        LabelBox* box = &boxes[label];
+        band->counts[label] += end - j;
+        if (j < box->umin) box->umin = j;
+        if (end - 1 > box->umax) box->umax = end - 1;
+        if (i < box->vmin) box->vmin = i;
+        box->vmax = i;  // rows are visited in increasing order
+        j = end;
+      }
+    }
+    return;
+  }
+
+  uint32 c0[FIXED_LUT_SIZE] = {0};
+  uint32 c1[FIXED_LUT_SIZE] = {0};
+  uint32 c2[FIXED_LUT_SIZE] = {0};
+  uint32 c3[FIXED_LUT_SIZE] = {0};
+  uint32* const sub[4] = {c0, c1, c2, c3};
+
+  for (uint32 i = band->v0; i < band->v1; i++) {
+    Kernels->histogram(img->image[i], w, sub);
+  }
+  for (uint32 k = 0; k < FIXED_LUT_SIZE; k++) {
+    band->counts[k] = c0[k] + c1[k] + c2[k] + c3[k];
+  }
+}
+
+/// Count the pixels of each label, optionally with their bounding boxes.
+void ImageLabelHistogram(const Image img, uint32 counts[], LabelBox boxes[]) {
+  assert(img != NULL);
+  assert(counts != NULL);
+
+  uint32 w = img->width;
+  uint32 h = img->height;
+  int nbands = NumBands((uint64_t)w * h, HISTOGRAM_MIN_BAND);
+  if ((uint32)nbands > h) nbands = (int)h;
+
+  struct histogramBand* bands = malloc(nbands * sizeof(*bands));
+  check(bands != NULL, "Alloc failed ->histogram bands");
+  LabelBox* band_boxes = NULL;
+  if (boxes != NULL) {
+    band_boxes = malloc((size_t)nbands * FIXED_LUT_SIZE * sizeof(LabelBox));
+    check(band_boxes != NULL, "Alloc failed ->histogram boxes");
+  }
+  for (int b = 0; b < nbands; b++) {
+    bands[b].v0 = BandStart(h, nbands, b);
+    bands[b].v1 = BandStart(h, nbands, b + 1);
+    bands[b].boxes = band_boxes ? band_boxes + (size_t)b * FIXED_LUT_SIZE : NULL;
+  }
+
+  struct histogramJob job = {img, bands};
+  ParallelRun(nbands, HistogramBand, &job);
+  PIXMEM += (unsigned long)w * h;
+
+  // Reduce the bands
+  for (uint16 k = 0; k < img->num_colors; k++) {
+    counts[k] = 0;
+    if (boxes != NULL) {
+      boxes[k].umin = w;
+      boxes[k].vmin = h;
+      boxes[k].umax = boxes[k].vmax = 0;
+    }
+    for (int b = 0; b < nbands; b++) {
+      if (bands[b].counts[k] == 0) continue;
+      counts[k] += bands[b].counts[k];
+      if (boxes != NULL) {
+        const LabelBox* bb = &bands[b].boxes[k];
+        if (bb->umin < boxes[k].umin) boxes[k].umin = bb->umin;
+        if (bb->vmin < boxes[k].vmin) boxes[k].vmin = bb->vmin;
+        if (bb->umax > boxes[k].umax) boxes[k].umax = bb->umax;
+        if (bb->vmax > boxes[k].vmax) boxes[k].vmax = bb->vmax;
+      }
+    }
+  }
+
+  free(band_boxes);
+  free(bands);
+}
+
 /// Image comparison
 
 /// These functions do not modify the images and never fail.
@@ -606,6 +852,102 @@ int ImageIsDifferent(const Image img1, const Image img2) {
   return !ImageIsEqual(img1, img2);
 }
 
+/// Check if img1 and img2 have the same regions, up to relabeling.
+int ImageIsSamePartition(const Image img1, const Image img2) {
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+
+  if (img1->width != img2->width || img1->height != img2->height) return 0;
+
+  // Label maps in both directions (0 = not yet seen, else label + 1)
+  uint32 map12[FIXED_LUT_SIZE] = {0};
+  uint32 map21[FIXED_LUT_SIZE] = {0};
+  for (uint32 i = 0; i < img1->height; i++) {
+    for (uint32 j = 0; j < img1->width; j++) {
+      uint16 l1 = img1->image[i][j];
+      uint16 l2 = img2->image[i][j];
+      PIXMEM += 2;
+      if (map12[l1] == 0 && map21[l2] == 0) {
+        map12[l1] = l2 + 1u;
+        map21[l2] = l1 + 1u;
+      } else if (map12[l1] != l2 + 1u || map21[l2] != l1 + 1u) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// Coordinate mapping of each D4 orientation, indexed by D4_* code.
+// Pixel (r, c) of the transformed image is read from img1 at
+//   row = r0 + r*rr + c*rc,  col = c0 + r*cr + c*cc
+// where r0 (c0) is H-1 (W-1) if the row (column) runs backwards, else 0.
+// swap is set when the transform exchanges width and height.
+static const struct {
+  int swap;
+  int rr, rc;
+  int cr, cc;
+} d4maps[8] = {
+    {0, 1, 0, 0, 1},    // D4_IDENTITY
+    {1, 0, -1, 1, 0},   // D4_ROT90CW
+    {0, -1, 0, 0, -1},  // D4_ROT180
+    {1, 0, 1, -1, 0},   // D4_ROT270CW
+    {0, 1, 0, 0, -1},   // D4_FLIP_H
+    {0, -1, 0, 0, 1},   // D4_FLIP_V
+    {1, 0, 1, 1, 0},    // D4_TRANSPOSE
+    {1, 0, -1, -1, 0},  // D4_ANTITRANSPOSE
+};
+
+// Check if img2 == T(img1) for orientation code t.
+// Stops at the first mismatching pixel.
+static int D4Matches(const Image img1, const Image img2, int t) {
+  int swap = d4maps[t].swap;
+  uint32 w = swap ? img1->height : img1->width;
+  uint32 h = swap ? img1->width : img1->height;
+  if (img2->width != w || img2->height != h) return 0;
+
+  int rr = d4maps[t].rr, rc = d4maps[t].rc;
+  int cr = d4maps[t].cr, cc = d4maps[t].cc;
+  int r0 = (rr < 0 || rc < 0) ? (int)img1->height - 1 : 0;
+  int c0 = (cr < 0 || cc < 0) ? (int)img1->width - 1 : 0;
+  const rgb_t* lut1 = img1->LUT;
+  const rgb_t* lut2 = img2->LUT;
+
+  for (uint32 r = 0; r < h; r++) {
+    const uint16* row2 = img2->image[r];
+    if (rc == 0) {
+      // Rows of img2 are (possibly reversed) rows of img1
+      const uint16* row1 = img1->image[r0 + (int)r * rr];
+      int col = c0;
+      for (uint32 c = 0; c < w; c++, col += cc) {
+        PIXMEM++;
+        if (lut1[row1[col]] != lut2[row2[c]]) return 0;
+      }
+    } else {
+      // Rows of img2 are (possibly reversed) columns of img1
+      int col = c0 + (int)r * cr;
+      int row = r0;
+      for (uint32 c = 0; c < w; c++, row += rc) {
+        PIXMEM++;
+        if (lut1[img1->image[row][col]] != lut2[row2[c]]) return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/// Check if img2 is a rotated and/or flipped copy of img1.
+/// Returns the first matching D4_* code, or D4_NONE.
+int ImageIsEqualUpToD4(const Image img1, const Image img2) {
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+
+  for (int t = D4_IDENTITY; t <= D4_ANTITRANSPOSE; t++) {
+    if (D4Matches(img1, img2, t)) return t;
+  }
+  return D4_NONE;
+}
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -641,12 +983,15 @@ Image ImageRotate90CW(const Image img) {
         rotated->image[r] = AllocateRowArray(rotated->width);
     }
 
-    // Perform 90 CW rotation: new(r, c) = old(H - 1 - c, r)
-    for (uint32 r = 0; r < rotated->height; r++) {
-        for (uint32 c = 0; c < rotated->width; c++) {
-            rotated->image[r][c] = img->image[oldH - 1 - c][r];
-        }
+    // Perform 90 CW rotation: new(r, c) = old(H - 1 - c, r),
+    // i.e., transpose the old rows taken bottom-up
+    const uint16** flipped = malloc(oldH * sizeof(*flipped));
+    check(flipped != NULL, "Alloc failed ->rotation rows");
+    for (uint32 i = 0; i < oldH; i++) {
+        flipped[i] = img->image[oldH - 1 - i];
     }
+    Kernels->transpose(rotated->image, flipped, oldH, oldW);
+    free(flipped);
 
     return rotated;
 }
@@ -699,7 +1044,7 @@ int ImageIsValidPixel(const Image img, int u, int v) {
 
 /// Region Growing
 
-/// The following three *RegionFilling* functions perform region growing
+/// The following *RegionFilling* functions perform region growing
 /// using some variation of the 4-neighbors flood-filling algorithm:
 ///   Given the coordinates (u, v) of a seed pixel,
 ///   fill all similarly-colored adjacent pixels with a new color label.
@@ -714,31 +1059,138 @@ int ImageIsValidPixel(const Image img, int u, int v) {
 /// Each function carries out a different version of the algorithm.
 
 
+/// Flood-fill workspace
+
+// Initial capacity of the containers of a fill context.
+// They grow (and stay grown) as the fills demand.
+#define FILL_CONTEXT_INITIAL_SIZE 1024
+
+// Internal structure of a flood-fill workspace
+struct fillContext {
+  IndexStack* stack;  // pending pixels of the STACK/scanline fills (or NULL)
+  IndexQueue* queue;  // pending pixels of the QUEUE fill (or NULL)
+};
+
+/// Create a flood-fill workspace.
+FillContext FillContextCreate(void) {
+  FillContext ctx = malloc(sizeof(struct fillContext));
+  check(ctx != NULL, "Alloc failed ->fill context");
+  ctx->stack = NULL;
+  ctx->queue = NULL;
+  return ctx;
+}
+
+/// Destroy the flood-fill workspace pointed to by (*ctxp).
+void FillContextDestroy(FillContext* ctxp) {
+  assert(ctxp != NULL);
+  FillContext ctx = *ctxp;
+  if (ctx == NULL) return;
+  if (ctx->stack != NULL) IndexStackDestroy(&ctx->stack);
+  if (ctx->queue != NULL) IndexQueueDestroy(&ctx->queue);
+  free(ctx);
+  *ctxp = NULL;
+}
+
+/// Peak number of blocks used by the QUEUE fills of ctx.
+uint32 FillContextQueuePeakBlocks(const FillContext ctx) {
+  assert(ctx != NULL);
+  return ctx->queue != NULL ? IndexQueuePeakBlocks(ctx->queue) : 0;
+}
+
+// Get the (empty) stack of ctx, creating it on first use.
+static IndexStack* FillContextStack(FillContext ctx) {
+  if (ctx->stack == NULL) {
+    ctx->stack = IndexStackCreate(FILL_CONTEXT_INITIAL_SIZE);
+  }
+  IndexStackClear(ctx->stack);
+  return ctx->stack;
+}
+
+// Get the (empty) queue of ctx, creating it on first use.
+static IndexQueue* FillContextQueue(FillContext ctx) {
+  if (ctx->queue == NULL) {
+    ctx->queue = IndexQueueCreate(FILL_CONTEXT_INITIAL_SIZE);
+  }
+  IndexQueueClear(ctx->queue);
+  return ctx->queue;
+}
+
+// Default maximum recursion depth of the recursive fill
+#define FILL_DEFAULT_MAX_DEPTH 10000
+
+// Maximum recursion depth of the recursive fill
+static uint32 fill_max_depth = FILL_DEFAULT_MAX_DEPTH;
+
+/// Set the maximum recursion depth of the recursive fill.
+void ImageSetFillRecursionLimit(uint32 depth) {
+  assert(depth > 0);
+  fill_max_depth = depth;
+}
+
+// Estado partilhado pelas chamadas recursivas
+struct recursiveFill {
+  Image img;
+  uint16 original;      // cor original da região
+  uint16 new_label;     // nova cor
+  FillContext ctx;      // workspace (para os pixeis adiados)
+  IndexStack* deferred;  // pixeis adiados por excesso de profundidade
+};
+
 // função recursiva auxiliar
-int fillRecursive(Image img, int x, int y, uint16 original, uint16 new_label) {
+// Past the maximum depth, a pixel is not filled here but deferred to an
+// explicit stack, and its region is continued later with a fresh call
+// stack (see ImageRegionFillingRecursiveCtx).
+static int fillRecursive(struct recursiveFill* f, int x, int y,
+                         uint32 depth) {
+  Image img = f->img;
+  PUSHES++;  // cada chamada é um pixel pendente
+
   // base case: pixel inválido ou cor diferente da original
-  if (!ImageIsValidPixel(img, x, y) || img->image[y][x] != original) {
+  if (!ImageIsValidPixel(img, x, y)) {
+    return 0;
+  }
+  PIXMEM++;
+  if (img->image[y][x] != f->original) {
+    return 0;
+  }
+
+  // demasiado fundo: adiar o pixel
+  if (depth >= fill_max_depth) {
+    if (f->deferred == NULL) f->deferred = FillContextStack(f->ctx);
+    IndexStackPush(f->deferred, PixelIndexCreate(img->width, x, y));
     return 0;
   }
   
   // preencher o pixel
-  img->image[y][x] = new_label;
+  img->image[y][x] = f->new_label;
+  PIXMEM++;
   int count = 1;
   
   // chamar recursivamente para os 4 vizinhos
-  count += fillRecursive(img, x + 1, y, original, new_label);  // direita
-  count += fillRecursive(img, x - 1, y, original, new_label);  // esquerda
-  count += fillRecursive(img, x, y + 1, original, new_label);  // baixo
-  count += fillRecursive(img, x, y - 1, original, new_label);  // cima
+  count += fillRecursive(f, x + 1, y, depth + 1);  // direita
+  count += fillRecursive(f, x - 1, y, depth + 1);  // esquerda
+  count += fillRecursive(f, x, y + 1, depth + 1);  // baixo
+  count += fillRecursive(f, x, y - 1, depth + 1);  // cima
   
   return count;
 }
 
 /// Region growing using the recursive flood-filling algorithm.
 int ImageRegionFillingRecursive(Image img, int u, int v, uint16 label) {
+  FillContext ctx = FillContextCreate();
+  int count = ImageRegionFillingRecursiveCtx(ctx, img, u, v, label);
+  FillContextDestroy(&ctx);
+  return count;
+}
+
+/// Region growing with the recursive algorithm, using the workspace ctx.
+int ImageRegionFillingRecursiveCtx(FillContext ctx, Image img, int u, int v,
+                                   uint16 label) {
+  assert(ctx != NULL);
   assert(img != NULL);
   assert(ImageIsValidPixel(img, u, v));
   assert(label < FIXED_LUT_SIZE);
+  assert((uint64_t)img->width * img->height - 1 <= PIXEL_INDEX_MAX);
   
   // cor original do pixel
   uint16 original_label = img->image[v][u];
@@ -747,145 +1199,2427 @@ int ImageRegionFillingRecursive(Image img, int u, int v, uint16 label) {
   if (original_label == label) {
     return 0;
   }
-  return fillRecursive(img, u, v, original_label, label);
-}
 
-/// Region growing using a STACK of pixel coordinates to
-/// implement the flood-filling algorithm.
-int ImageRegionFillingWithSTACK(Image img, int u, int v, uint16 label) {
-  assert(img != NULL);
-  assert(ImageIsValidPixel(img, u, v));
-  assert(label < FIXED_LUT_SIZE);
+  struct recursiveFill f = {img, original_label, label, ctx, NULL};
+  int count = fillRecursive(&f, u, v, 0);
 
-  // cor original do pixel
-  uint16 original_label = img->image[v][u];
-  if (original_label == label) {
-    return 0;
+  // continuar a partir dos pixeis adiados
+  while (f.deferred != NULL && !IndexStackIsEmpty(f.deferred)) {
+    PixelIndex p = IndexStackPop(f.deferred);
+    count += fillRecursive(&f, PixelIndexGetU(p, img->width),
+                           PixelIndexGetV(p, img->width), 0);
   }
+  return count;
+}
+
+// Flood-fill engine
+//
+// A STACK fill parameterized by the neighborhood (4 or 8 neighbors) and
+// by the match predicate (exact label, or membership in a per-label
+// bitmap of matching labels). FILL_KERNEL instantiates one kernel per
+// combination, with the parameters as constants, so each kernel is
+// compiled without the tests it does not need.
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+// Words of a bitmap with one bit per LUT label
+#define LABEL_BITMAP_WORDS ((FIXED_LUT_SIZE + 63) / 64)
+
+static inline int LabelBitmapTest(const uint64_t* bitmap, uint16 l) {
+  return (int)(bitmap[l >> 6] >> (l & 63)) & 1;
+}
 
-  // criar stack
-  uint32 max_size = img->width * img->height;
-  Stack* stack = StackCreate(max_size);
+// Fill the region of (u, v) with label, using the empty stack.
+// A pixel belongs to the region if its label is original_label
+// (tolerant == 0) or has its bit set in matches (tolerant != 0).
+static ALWAYS_INLINE int FillKernel(IndexStack* stack, Image img, int u,
+                                    int v, uint16 label,
+                                    uint16 original_label,
+                                    const uint64_t* matches, int eight,
+                                    int tolerant) {
+  uint32 w = img->width;
+  uint32 h = img->height;
   int count = 0;  // Contador de pixels preenchidos
 
   // adicionar pixel inicial ao stack
-  PixelCoords seed = PixelCoordsCreate(u, v);
-  StackPush(stack, seed);
-
-  while (!StackIsEmpty(stack)){
-    PixelCoords current = StackPop(stack);
-    int x = PixelCoordsGetU(current);
-    int y = PixelCoordsGetV(current);
-
-    // verificar se é válido e tem a cor original
-    if (!ImageIsValidPixel(img, x, y) || img->image[y][x] != original_label) {
+  IndexStackPush(stack, PixelIndexCreate(w, u, v));
+  PUSHES++;
+
+  while (!IndexStackIsEmpty(stack)){
+    PixelIndex current = IndexStackPop(stack);
+    uint32 x = (uint32)PixelIndexGetU(current, w);
+    uint32 y = (uint32)PixelIndexGetV(current, w);
+
+    // verificar se pertence à região (o stack só tem pixeis válidos)
+    PIXMEM++;
+    uint16 l = img->image[y][x];
+    if (tolerant ? !LabelBitmapTest(matches, l) : l != original_label) {
       continue;
     }
     
     // colocar o pixel
     img->image[y][x] = label;
+    PIXMEM++;
     count++;
     
-    // adicionar vizinhos ao stack
-    if (!StackIsFull(stack)) {
-      StackPush(stack, PixelCoordsCreate(x+1, y));
-      StackPush(stack, PixelCoordsCreate(x-1, y));
-      StackPush(stack, PixelCoordsCreate(x, y+1));
-      StackPush(stack, PixelCoordsCreate(x, y-1));
+    // adicionar vizinhos válidos ao stack
+    if (x + 1 < w) { IndexStackPush(stack, current + 1); PUSHES++; }
+    if (x > 0)     { IndexStackPush(stack, current - 1); PUSHES++; }
+    if (y + 1 < h) { IndexStackPush(stack, current + w); PUSHES++; }
+    if (y > 0)     { IndexStackPush(stack, current - w); PUSHES++; }
+    if (eight) {
+      if (y + 1 < h && x + 1 < w) { IndexStackPush(stack, current + w + 1); PUSHES++; }
+      if (y + 1 < h && x > 0)     { IndexStackPush(stack, current + w - 1); PUSHES++; }
+      if (y > 0 && x + 1 < w)     { IndexStackPush(stack, current - w + 1); PUSHES++; }
+      if (y > 0 && x > 0)         { IndexStackPush(stack, current - w - 1); PUSHES++; }
+    }
+  }
+
+  return count;
+}
+
+#define FILL_KERNEL(name, eight, tolerant)                                  \
+  static int name(IndexStack* stack, Image img, int u, int v, uint16 label, \
+                  uint16 original_label, const uint64_t* matches) {         \
+    return FillKernel(stack, img, u, v, label, original_label, matches,     \
+                      eight, tolerant);                                     \
+  }
+
+FILL_KERNEL(FillExact4, 0, 0)
+FILL_KERNEL(FillExact8, 1, 0)
+FILL_KERNEL(FillTolerant4, 0, 1)
+FILL_KERNEL(FillTolerant8, 1, 1)
+
+// Set the bits of the labels whose color is within Euclidean RGB distance
+// tolerance of the color of original_label. Labels without a LUT entry
+// only match themselves.
+static void LabelMatchBitmap(const Image img, uint16 original_label,
+                             uint32 tolerance, uint64_t matches[]) {
+  memset(matches, 0, LABEL_BITMAP_WORDS * sizeof(matches[0]));
+  matches[original_label >> 6] |= 1ull << (original_label & 63);
+  if (original_label >= img->num_colors) return;
+
+  rgb_t c0 = img->LUT[original_label];
+  uint64_t limit = (uint64_t)tolerance * tolerance;
+  for (uint16 l = 0; l < img->num_colors; l++) {
+    rgb_t c = img->LUT[l];
+    int64_t dr = (int64_t)(c >> 16 & 0xff) - (c0 >> 16 & 0xff);
+    int64_t dg = (int64_t)(c >> 8 & 0xff) - (c0 >> 8 & 0xff);
+    int64_t db = (int64_t)(c & 0xff) - (c0 & 0xff);
+    if ((uint64_t)(dr * dr + dg * dg + db * db) <= limit) {
+      matches[l >> 6] |= 1ull << (l & 63);
     }
   }
+}
+
+/// Region growing with a choice of neighborhood and color matching.
+int ImageRegionFillingEx(Image img, int u, int v, uint16 label,
+                         int connectivity, uint32 tolerance) {
+  FillContext ctx = FillContextCreate();
+  int count = ImageRegionFillingExCtx(ctx, img, u, v, label, connectivity,
+                                      tolerance);
+  FillContextDestroy(&ctx);
+  return count;
+}
+
+/// Region growing with a choice of neighborhood and color matching,
+/// using the workspace ctx.
+int ImageRegionFillingExCtx(FillContext ctx, Image img, int u, int v,
+                            uint16 label, int connectivity,
+                            uint32 tolerance) {
+  assert(ctx != NULL);
+  assert(img != NULL);
+  assert(ImageIsValidPixel(img, u, v));
+  assert(label < FIXED_LUT_SIZE);
+  assert(connectivity == 4 || connectivity == 8);
+  assert((uint64_t)img->width * img->height - 1 <= PIXEL_INDEX_MAX);
+
+  uint16 original_label = img->image[v][u];
+  if (original_label == label) {
+    return 0;
+  }
+
+  IndexStack* stack = FillContextStack(ctx);
+  if (tolerance == 0) {
+    return connectivity == 4
+               ? FillExact4(stack, img, u, v, label, original_label, NULL)
+               : FillExact8(stack, img, u, v, label, original_label, NULL);
+  }
+
+  // The new label never matches, so filled pixels are not revisited
+  uint64_t matches[LABEL_BITMAP_WORDS];
+  LabelMatchBitmap(img, original_label, tolerance, matches);
+  matches[label >> 6] &= ~(1ull << (label & 63));
+  return connectivity == 4
+             ? FillTolerant4(stack, img, u, v, label, original_label, matches)
+             : FillTolerant8(stack, img, u, v, label, original_label, matches);
+}
 
-  StackDestroy(&stack);
+/// Region growing using a STACK of pixel coordinates to
+/// implement the flood-filling algorithm.
+int ImageRegionFillingWithSTACK(Image img, int u, int v, uint16 label) {
+  FillContext ctx = FillContextCreate();
+  int count = ImageRegionFillingWithSTACKCtx(ctx, img, u, v, label);
+  FillContextDestroy(&ctx);
   return count;
 }
 
+/// Region growing with a STACK, using the workspace ctx.
+int ImageRegionFillingWithSTACKCtx(FillContext ctx, Image img, int u, int v,
+                                   uint16 label) {
+  assert(ctx != NULL);
+  assert(img != NULL);
+  assert(ImageIsValidPixel(img, u, v));
+  assert(label < FIXED_LUT_SIZE);
+  assert((uint64_t)img->width * img->height - 1 <= PIXEL_INDEX_MAX);
+
+  // cor original do pixel
+  uint16 original_label = img->image[v][u];
+  if (original_label == label) {
+    return 0;
+  }
+
+  // stack do workspace (cresce conforme necessário)
+  IndexStack* stack = FillContextStack(ctx);
+  return FillExact4(stack, img, u, v, label, original_label, NULL);
+}
+
 /// Region growing using a QUEUE of pixel coordinates to
 /// implement the flood-filling algorithm.
 int ImageRegionFillingWithQUEUE(Image img, int u, int v, uint16 label) {
+  FillContext ctx = FillContextCreate();
+  int count = ImageRegionFillingWithQUEUECtx(ctx, img, u, v, label);
+  FillContextDestroy(&ctx);
+  return count;
+}
+
+/// Region growing with a QUEUE, using the workspace ctx.
+int ImageRegionFillingWithQUEUECtx(FillContext ctx, Image img, int u, int v,
+                                   uint16 label) {
+  assert(ctx != NULL);
   assert(img != NULL);
   assert(ImageIsValidPixel(img, u, v));
   assert(label < FIXED_LUT_SIZE);
+  assert((uint64_t)img->width * img->height - 1 <= PIXEL_INDEX_MAX);
 
   // cor original do pixel
   uint16 original_label = img->image[v][u];
     if (original_label == label)
       return 0;
 
-  // criar queue
-  uint32 max_size = img->width * img->height;
-  Queue *queue = QueueCreate(max_size);
+  // queue do workspace (cresce conforme necessário)
+  IndexQueue *queue = FillContextQueue(ctx);
+  uint32 w = img->width;
+  uint32 h = img->height;
   int count = 0;  // Contador de pixels preenchidos
 
   // adicionar o pixel inicial na queue
-  QueueEnqueue(queue, PixelCoordsCreate(u, v));
+  IndexQueueEnqueue(queue, PixelIndexCreate(w, u, v));
+  PUSHES++;
 
-  while (!QueueIsEmpty(queue)) {
-    PixelCoords current = QueueDequeue(queue);
-    int x = PixelCoordsGetU(current);
-    int y = PixelCoordsGetV(current);
+  while (!IndexQueueIsEmpty(queue)) {
+    PixelIndex current = IndexQueueDequeue(queue);
+    uint32 x = (uint32)PixelIndexGetU(current, w);
+    uint32 y = (uint32)PixelIndexGetV(current, w);
 
-    // verificar se é válido e tem a cor original
-    if (!ImageIsValidPixel(img, x, y) || img->image[y][x] != original_label)
+    // verificar se tem a cor original (a queue só tem pixeis válidos)
+    PIXMEM++;
+    if (img->image[y][x] != original_label)
       continue;
 
     // colocar o pixel
     img->image[y][x] = label;
+    PIXMEM++;
     count++;
 
-    // adicionar vizinhos à queue
-    if (!QueueIsFull(queue)) {
-      QueueEnqueue(queue, PixelCoordsCreate(x + 1, y));
-      QueueEnqueue(queue, PixelCoordsCreate(x - 1, y));
-      QueueEnqueue(queue, PixelCoordsCreate(x, y + 1));
-      QueueEnqueue(queue, PixelCoordsCreate(x, y - 1));
-    }
+    // adicionar vizinhos válidos à queue
+    if (x + 1 < w) { IndexQueueEnqueue(queue, current + 1); PUSHES++; }
+    if (x > 0)     { IndexQueueEnqueue(queue, current - 1); PUSHES++; }
+    if (y + 1 < h) { IndexQueueEnqueue(queue, current + w); PUSHES++; }
+    if (y > 0)     { IndexQueueEnqueue(queue, current - w); PUSHES++; }
   }
 
-    QueueDestroy(&queue);
     return count;
 }
 
-/// Image Segmentation
+// Pixel runs
+//
+// The scanline fill works on runs of equal labels within a row.
+// Runs are found forward by the row kernels of the selected instruction
+// set level (see imageKernels.h). Backward, four 16-bit labels are loaded
+// into a 64-bit word and compared with a word holding four copies of the
+// label (SWAR, SIMD within a register).
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SWAR_RUNS 1
+#else
+#define SWAR_RUNS 0
+#endif
+
+// Return the first index i in [from, to) with row[i] != value,
+// or to if there is none.
+static inline uint32 RowRunEnd(const uint16* row, uint32 from, uint32 to,
+                               uint16 value) {
+  return Kernels->run_end(row, from, to, value);
+}
 
-/// Label each WHITE region with a different color.
-/// - WHITE (the background color) has label (LUT index) 0.
-/// - Use GenerateNextColor to create the RGB color for each new region.
-///
-/// One of the region filling functions above is passed as the
-/// last argument, using a function pointer.
-///
-/// Returns the number of image regions found.
-int ImageSegmentation(Image img, FillingFunction fillFunct) {
+// Return the first index i in [from, to) with row[i] == value,
+// or to if there is none.
+static inline uint32 RowFind(const uint16* row, uint32 from, uint32 to,
+                             uint16 value) {
+  return Kernels->find(row, from, to, value);
+}
+
+// Return the smallest index i <= from such that row[i..from] are all
+// equal to value.
+// Requires: row[from] == value.
+static uint32 RowRunStart(const uint16* row, uint32 from, uint16 value) {
+  uint32 i = from;  // row[i..from] == value
+#if SWAR_RUNS
+  uint64_t pattern = value * 0x0001000100010001ull;
+  for (; i >= 4; i -= 4) {
+    uint64_t word;
+    memcpy(&word, row + i - 4, sizeof(word));
+    uint64_t diff = word ^ pattern;
+    if (diff != 0) return i - (uint32)__builtin_clzll(diff) / 16;
+  }
+#endif
+  while (i > 0 && row[i - 1] == value) i--;
+  return i;
+}
+
+// Push one seed for each run of original pixels of row v within [x0, x1).
+static void PushRunSeeds(Image img, IndexStack* stack, uint32 v, uint32 x0,
+                         uint32 x1, uint16 original) {
+  const uint16* row = img->image[v];
+  uint32 x = x0;
+  while (x < x1) {
+    if (row[x] == original) {
+      IndexStackPush(stack, PixelIndexCreate(img->width, (int)x, (int)v));
+      PUSHES++;
+      uint32 end = RowRunEnd(row, x, x1, original);
+      PIXMEM += end - x;
+      x = end;
+    } else {
+      PIXMEM++;
+      x++;
+    }
+  }
+}
+
+/// Region growing using the scanline (span-based) flood-filling
+/// algorithm, with a STACK of seed pixels.
+/// Each popped seed fills the whole horizontal run of pixels around it.
+/// Only one seed is pushed per adjacent run, in the rows above and below.
+int ImageRegionFillingScanline(Image img, int u, int v, uint16 label) {
+  FillContext ctx = FillContextCreate();
+  int count = ImageRegionFillingScanlineCtx(ctx, img, u, v, label);
+  FillContextDestroy(&ctx);
+  return count;
+}
+
+/// Region growing with the scanline algorithm, using the workspace ctx.
+int ImageRegionFillingScanlineCtx(FillContext ctx, Image img, int u, int v,
+                                  uint16 label) {
+  assert(ctx != NULL);
   assert(img != NULL);
-  assert(fillFunct != NULL);
-  
-  int region_count = 0;
-  uint16 current_label = 1;  
-  rgb_t current_color = 0;  
+  assert(ImageIsValidPixel(img, u, v));
+  assert(label < FIXED_LUT_SIZE);
+  assert((uint64_t)img->width * img->height - 1 <= PIXEL_INDEX_MAX);
 
-  for (uint32 y = 0; y < img->height; y++) {
-    for (uint32 x = 0; x < img->width; x++) {
-      // se o pixel for branco (fundo)
-      if (img->image[y][x] == 0) {
-        // gerar uma cor nova
-        current_color = GenerateNextColor(current_color);
-        
-        // preencher a região com a cor nova
-        int pixels_filled = fillFunct(img, x, y, current_label);
-        
-        
-        if (pixels_filled > 0) {
-          region_count++;
-          current_label++;
-          
-          // verificar se ultrapassou o limite do LUT
-          if (current_label >= FIXED_LUT_SIZE) {
-            return region_count;
-          }
-        }
-      }
+  uint16 original_label = img->image[v][u];
+  if (original_label == label) {
+    return 0;
+  }
+
+  IndexStack* stack = FillContextStack(ctx);
+  int count = 0;
+
+  IndexStackPush(stack, PixelIndexCreate(img->width, u, v));
+  PUSHES++;
+
+  while (!IndexStackIsEmpty(stack)) {
+    PixelIndex current = IndexStackPop(stack);
+    uint32 x = (uint32)PixelIndexGetU(current, img->width);
+    uint32 y = (uint32)PixelIndexGetV(current, img->width);
+    uint16* row = img->image[y];
+
+    // The run may have been filled since this seed was pushed
+    PIXMEM++;
+    if (row[x] != original_label) continue;
+
+    // Extend the run to both sides and fill it
+    uint32 x0 = RowRunStart(row, x, original_label);
+    uint32 x1 = RowRunEnd(row, x, img->width, original_label);
+    PIXMEM += x1 - x0;
+    for (uint32 i = x0; i < x1; i++) {
+      row[i] = label;
+    }
+    PIXMEM += x1 - x0;
+    count += (int)(x1 - x0);
+
+    // Seed the adjacent runs
+    if (y > 0) {
+      PushRunSeeds(img, stack, y - 1, x0, x1, original_label);
+    }
+    if (y + 1 < img->height) {
+      PushRunSeeds(img, stack, y + 1, x0, x1, original_label);
     }
   }
-  
-  return region_count;
+
+  return count;
 }
+
+// Multi-seed fill
+//
+// The seeds are grown in seed order, one region at a time, with a single
+// setup: one frontier buffer and one visited bitmap shared by all of them.
+// A pixel is labeled when it is pushed, and is marked in the visited
+// bitmap, so that a pixel is never taken twice, even where a new label
+// equals the original label of a nearby region. The first seed in a
+// region claims all of it; later seeds in the same region find their
+// pixel visited and label nothing.
+
+// Growable array of frontier pixels
+typedef struct {
+  PixelIndex* items;
+  size_t size;
+  size_t capacity;
+} BatchFrontier;
+
+static void BatchFrontierPush(BatchFrontier* f, PixelIndex pixel) {
+  if (f->size == f->capacity) {
+    f->capacity = f->capacity == 0 ? 1024 : 2 * f->capacity;
+    PixelIndex* items = realloc(f->items, f->capacity * sizeof(PixelIndex));
+    check(items != NULL, "Alloc failed ->frontier");
+    f->items = items;
+  }
+  f->items[f->size++] = pixel;
+  PUSHES++;
+}
+
+/// Region growing from several seeds in a single traversal.
+int ImageRegionFillingBatch(Image img, const PixelCoords seeds[],
+                            const uint16 labels[], int n, int counts[]) {
+  assert(img != NULL);
+  assert(n >= 0);
+  assert(n == 0 || (seeds != NULL && labels != NULL && counts != NULL));
+  assert((uint64_t)img->width * img->height - 1 <= PIXEL_INDEX_MAX);
+
+  uint32 w = img->width;
+  uint32 h = img->height;
+  size_t words = ((size_t)w * h + 63) / 64;
+  uint64_t* visited = calloc(words > 0 ? words : 1, sizeof(uint64_t));
+  check(visited != NULL, "Alloc failed ->visited bitmap");
+
+  BatchFrontier frontier = {NULL, 0, 0};
+  int total = 0;
+
+  for (int i = 0; i < n; i++) {
+    int u = PixelCoordsGetU(seeds[i]);
+    int v = PixelCoordsGetV(seeds[i]);
+    assert(ImageIsValidPixel(img, u, v));
+    assert(labels[i] < FIXED_LUT_SIZE);
+    counts[i] = 0;
+
+    PixelIndex p = PixelIndexCreate(w, u, v);
+    PIXMEM++;
+    uint16 original = img->image[v][u];
+    if ((visited[p >> 6] >> (p & 63) & 1) || original == labels[i]) {
+      continue;
+    }
+    visited[p >> 6] |= 1ull << (p & 63);
+    img->image[v][u] = labels[i];
+    PIXMEM++;
+    counts[i]++;
+    BatchFrontierPush(&frontier, p);
+
+    while (frontier.size > 0) {
+      p = frontier.items[--frontier.size];
+      uint32 x = (uint32)PixelIndexGetU(p, w);
+      uint32 y = (uint32)PixelIndexGetV(p, w);
+
+      // Neighbors in the same order as the other fills
+      PixelIndex neighbors[4];
+      int nn = 0;
+      if (x + 1 < w) neighbors[nn++] = p + 1;
+      if (x > 0) neighbors[nn++] = p - 1;
+      if (y + 1 < h) neighbors[nn++] = p + w;
+      if (y > 0) neighbors[nn++] = p - w;
+
+      for (int j = 0; j < nn; j++) {
+        PixelIndex q = neighbors[j];
+        if (visited[q >> 6] >> (q & 63) & 1) continue;
+        uint16* pixel =
+            &img->image[PixelIndexGetV(q, w)][PixelIndexGetU(q, w)];
+        PIXMEM++;
+        if (*pixel != original) continue;
+        visited[q >> 6] |= 1ull << (q & 63);
+        *pixel = labels[i];
+        PIXMEM++;
+        counts[i]++;
+        BatchFrontierPush(&frontier, q);
+      }
+    }
+    total += counts[i];
+  }
+
+  free(frontier.items);
+  free(visited);
+  return total;
+}
+
+// Parallel fill
+//
+// Level-synchronous BFS. Levels with a small frontier are expanded by the
+// calling thread; larger ones are split among the threads, which claim
+// pixels with an atomic compare-and-swap of their label (original -> new),
+// so that each pixel is claimed exactly once. Each thread collects its part
+// of the next level in its own buffer.
+
+// Minimum frontier size per thread for a level to be expanded in parallel
+#define PARALLEL_FILL_MIN_FRONTIER 1024
+
+// Growable array of pixel indices
+typedef struct {
+  PixelIndex* items;
+  size_t size;
+  size_t capacity;
+} IndexBuffer;
+
+static void IndexBufferReserve(IndexBuffer* b, size_t n) {
+  if (n <= b->capacity) return;
+  size_t capacity = b->capacity == 0 ? 1024 : b->capacity;
+  while (capacity < n) capacity *= 2;
+  PixelIndex* items = realloc(b->items, capacity * sizeof(PixelIndex));
+  check(items != NULL, "Alloc failed ->frontier");
+  b->items = items;
+  b->capacity = capacity;
+}
+
+static inline void IndexBufferPush(IndexBuffer* b, PixelIndex p) {
+  if (b->size == b->capacity) IndexBufferReserve(b, b->size + 1);
+  b->items[b->size++] = p;
+}
+
+// State of one thread of the parallel fill
+struct fillTask {
+  IndexBuffer next;  // pixels claimed for the next level
+  uint64_t pixmem;   // local instrumentation counts
+  uint64_t pushes;
+};
+
+struct parallelFill {
+  Image img;
+  uint16 original;
+  uint16 label;
+  const IndexBuffer* frontier;
+  int ntasks;
+  struct fillTask* tasks;
+};
+
+// Set *pixel from original to label, if it is still original.
+// Returns nonzero if this call claimed the pixel.
+static ALWAYS_INLINE int ClaimPixel(uint16* pixel, uint16 original,
+                                    uint16 label, int atomic) {
+  if (!atomic) {
+    if (*pixel != original) return 0;
+    *pixel = label;
+    return 1;
+  }
+  if (__atomic_load_n(pixel, __ATOMIC_RELAXED) != original) return 0;
+  uint16 expected = original;
+  return __atomic_compare_exchange_n(pixel, &expected, label, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// Claim the unclaimed neighbors of frontier[from..to) into t->next.
+static ALWAYS_INLINE void ExpandFrontier(struct parallelFill* pf, size_t from,
+                                         size_t to, struct fillTask* t,
+                                         int atomic) {
+  Image img = pf->img;
+  uint32 w = img->width;
+  uint32 h = img->height;
+  for (size_t k = from; k < to; k++) {
+    PixelIndex p = pf->frontier->items[k];
+    uint32 x = (uint32)PixelIndexGetU(p, w);
+    uint32 y = (uint32)PixelIndexGetV(p, w);
+    uint16* row = img->image[y];
+
+    t->pushes += (x + 1 < w) + (x > 0) + (y + 1 < h) + (y > 0);
+    if (x + 1 < w && ClaimPixel(&row[x + 1], pf->original, pf->label, atomic))
+      IndexBufferPush(&t->next, p + 1);
+    if (x > 0 && ClaimPixel(&row[x - 1], pf->original, pf->label, atomic))
+      IndexBufferPush(&t->next, p - 1);
+    if (y + 1 < h &&
+        ClaimPixel(&img->image[y + 1][x], pf->original, pf->label, atomic))
+      IndexBufferPush(&t->next, p + w);
+    if (y > 0 &&
+        ClaimPixel(&img->image[y - 1][x], pf->original, pf->label, atomic))
+      IndexBufferPush(&t->next, p - w);
+  }
+  // One read per neighbor, one write per claimed pixel
+  t->pixmem += t->pushes + t->next.size;
+}
+
+static void ParallelFillTask(void* arg, int task) {
+  struct parallelFill* pf = arg;
+  size_t n = pf->frontier->size;
+  size_t from = n * (size_t)task / (size_t)pf->ntasks;
+  size_t to = n * (size_t)(task + 1) / (size_t)pf->ntasks;
+  ExpandFrontier(pf, from, to, &pf->tasks[task], 1);
+}
+
+/// Region growing using a parallel, level-synchronous BFS.
+int ImageRegionFillingParallel(Image img, int u, int v, uint16 label) {
+  assert(img != NULL);
+  assert(ImageIsValidPixel(img, u, v));
+  assert(label < FIXED_LUT_SIZE);
+  assert((uint64_t)img->width * img->height - 1 <= PIXEL_INDEX_MAX);
+
+  uint16 original_label = img->image[v][u];
+  if (original_label == label) {
+    return 0;
+  }
+
+  int nthreads = ImageThreads();
+  struct fillTask tasks[nthreads];  // using VLAs...
+  memset(tasks, 0, sizeof(tasks));
+  IndexBuffer current = {NULL, 0, 0};
+  struct parallelFill pf = {img, original_label, label, &current, 1, tasks};
+
+  // Claim the seed
+  img->image[v][u] = label;
+  PIXMEM += 2;
+  PUSHES++;
+  IndexBufferPush(&current, PixelIndexCreate(img->width, u, v));
+  uint64_t count = 1;
+
+  while (current.size > 0) {
+    pf.ntasks = NumBands(current.size, PARALLEL_FILL_MIN_FRONTIER);
+    if (pf.ntasks > nthreads) pf.ntasks = nthreads;  // tasks[] size
+    if (pf.ntasks == 1) {
+      ExpandFrontier(&pf, 0, current.size, &tasks[0], 0);
+    } else {
+      ParallelRun(pf.ntasks, ParallelFillTask, &pf);
+    }
+
+    // The next level is the concatenation of the tasks' buffers
+    if (pf.ntasks == 1) {
+      IndexBuffer tmp = current;
+      current = tasks[0].next;
+      tasks[0].next = tmp;
+    } else {
+      size_t size = 0;
+      for (int t = 0; t < pf.ntasks; t++) size += tasks[t].next.size;
+      IndexBufferReserve(&current, size);
+      current.size = 0;
+      for (int t = 0; t < pf.ntasks; t++) {
+        memcpy(current.items + current.size, tasks[t].next.items,
+               tasks[t].next.size * sizeof(PixelIndex));
+        current.size += tasks[t].next.size;
+      }
+    }
+    count += current.size;
+
+    for (int t = 0; t < pf.ntasks; t++) {
+      PIXMEM += tasks[t].pixmem;
+      PUSHES += tasks[t].pushes;
+      tasks[t].pixmem = tasks[t].pushes = 0;
+      tasks[t].next.size = 0;
+    }
+  }
+
+  free(current.items);
+  for (int t = 0; t < nthreads; t++) free(tasks[t].next.items);
+  return (int)count;
+}
+
+// Return the variant of fillFunct that takes a workspace, or NULL if
+// fillFunct has no such variant.
+static FillingFunctionCtx FillingFunctionWithContext(FillingFunction fillFunct) {
+  if (fillFunct == ImageRegionFillingRecursive)
+    return ImageRegionFillingRecursiveCtx;
+  if (fillFunct == ImageRegionFillingWithSTACK)
+    return ImageRegionFillingWithSTACKCtx;
+  if (fillFunct == ImageRegionFillingWithQUEUE)
+    return ImageRegionFillingWithQUEUECtx;
+  if (fillFunct == ImageRegionFillingScanline)
+    return ImageRegionFillingScanlineCtx;
+  return NULL;
+}
+
+/// Image Segmentation
+
+/// Label each WHITE region with a different color.
+/// - WHITE (the background color) has label (LUT index) 0.
+/// - Use GenerateNextColor to create the RGB color for each new region.
+///
+/// One of the region filling functions above is passed as the
+/// last argument, using a function pointer.
+///
+/// Returns the number of image regions found.
+
+int ImageSegmentation(Image img, FillingFunction fillFunct) {
+  assert(img != NULL);
+  assert(fillFunct != NULL);
+
+  // Um único workspace para todas as regiões
+  FillingFunctionCtx fillCtxFunct = FillingFunctionWithContext(fillFunct);
+  FillContext ctx = fillCtxFunct != NULL ? FillContextCreate() : NULL;
+  
+  int region_count = 0;
+  rgb_t current_color = 0;  
+
+  for (uint32 y = 0; y < img->height; y++) {
+    for (uint32 x = 0; x < img->width; x++) {
+      // se o pixel for branco (fundo)
+      if (img->image[y][x] == WHITE) {
+        // verificar se ultrapassou o limite do LUT
+        if (img->num_colors >= FIXED_LUT_SIZE) {
+          FillContextDestroy(&ctx);
+          return region_count;
+        }
+
+        // gerar uma cor nova, na próxima entrada do LUT
+        current_color = GenerateNextColor(current_color);
+        uint16 current_label = img->num_colors;
+        
+        // preencher a região com a cor nova
+        int pixels_filled =
+            fillCtxFunct != NULL
+                ? fillCtxFunct(ctx, img, (int)x, (int)y, current_label)
+                : fillFunct(img, (int)x, (int)y, current_label);
+        
+        if (pixels_filled > 0) {
+          img->LUT[img->num_colors++] = current_color;
+          region_count++;
+        }
+      }
+    }
+  }
+
+  FillContextDestroy(&ctx);
+  return region_count;
+}
+
+// Union-find over provisional region labels
+//
+// Labels are created in increasing order, and a union always links the
+// larger root under the smaller one, so every parent is smaller than its
+// child and the root of a set is its oldest label.
+
+// No provisional label (pixel is not WHITE)
+#define NO_LABEL UINT32_MAX
+
+typedef struct {
+  uint32* parent;
+  uint32 size;
+  uint32 capacity;
+} UnionFind;
+
+static uint32 UFNew(UnionFind* uf) {
+  if (uf->size == uf->capacity) {
+    uf->capacity = uf->capacity == 0 ? 1024 : 2 * uf->capacity;
+    uint32* parent = realloc(uf->parent, uf->capacity * sizeof(uint32));
+    check(parent != NULL, "Alloc failed ->union-find");
+    uf->parent = parent;
+  }
+  uf->parent[uf->size] = uf->size;
+  return uf->size++;
+}
+
+// Find the root of x, halving the path on the way.
+static uint32 UFFind(UnionFind* uf, uint32 x) {
+  uint32* parent = uf->parent;
+  while (parent[x] != x) {
+    parent[x] = parent[parent[x]];
+    x = parent[x];
+  }
+  return x;
+}
+
+static void UFUnion(UnionFind* uf, uint32 a, uint32 b) {
+  a = UFFind(uf, a);
+  b = UFFind(uf, b);
+  if (a < b) {
+    uf->parent[b] = a;
+  } else if (b < a) {
+    uf->parent[a] = b;
+  }
+}
+
+// Replace each parent entry by the final label of its set: roots, in
+// increasing order, get labels first, first + 1, ...; roots past the last
+// LUT entry get WHITE. Returns the number of labeled sets.
+// (Valid because parent[x] <= x: parent[x] is already replaced when x is.)
+static int UFResolveLabels(UnionFind* uf, uint32 first) {
+  uint32* parent = uf->parent;
+  uint32 next = first;
+  for (uint32 x = 0; x < uf->size; x++) {
+    if (parent[x] == x) {
+      parent[x] = next < FIXED_LUT_SIZE ? next++ : WHITE;
+    } else {
+      parent[x] = parent[parent[x]];
+    }
+  }
+  return (int)(next - first);
+}
+
+// Provisional label of WHITE pixel (x, y), given the labels of the row
+// above (prev) and of the pixels to its left (cur). Creates a new label,
+// or records an equivalence, if uf != NULL; otherwise replays the labels
+// created by an earlier call with the same image (next counts them).
+static inline uint32 ProvisionalLabel(UnionFind* uf, uint32* next,
+                                      const uint32* prev, const uint32* cur,
+                                      uint32 x) {
+  uint32 left = x > 0 ? cur[x - 1] : NO_LABEL;
+  uint32 up = prev[x];
+  if (left == NO_LABEL && up == NO_LABEL) {
+    return uf != NULL ? UFNew(uf) : (*next)++;
+  }
+  if (left == NO_LABEL) return up;
+  if (up != NO_LABEL && uf != NULL && up != left) UFUnion(uf, left, up);
+  return left;
+}
+
+// Union of the sets of a and b, safe against concurrent unions and finds
+// on the same parent array: a root is linked under a smaller root with a
+// compare-and-swap, retrying if it stopped being a root meanwhile.
+static uint32 UFFindAtomic(uint32* parent, uint32 x) {
+  uint32 p;
+  while ((p = __atomic_load_n(&parent[x], __ATOMIC_RELAXED)) != x) {
+    // Path halving: any ancestor is a valid parent
+    uint32 gp = __atomic_load_n(&parent[p], __ATOMIC_RELAXED);
+    __atomic_store_n(&parent[x], gp, __ATOMIC_RELAXED);
+    x = gp;
+  }
+  return x;
+}
+
+static void UFUnionAtomic(uint32* parent, uint32 a, uint32 b) {
+  for (;;) {
+    a = UFFindAtomic(parent, a);
+    b = UFFindAtomic(parent, b);
+    if (a == b) return;
+    if (a > b) {
+      uint32 t = a;
+      a = b;
+      b = t;
+    }
+    uint32 expected = b;
+    if (__atomic_compare_exchange_n(&parent[b], &expected, a, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      return;
+    }
+  }
+}
+
+// Band-parallel labeling
+//
+// The image is split into bands of rows, labeled independently: each band
+// numbers its provisional labels from 0, in raster order, as if it were a
+// whole image. Placing the bands' labels one after the other (offset) gives
+// global labels that are still in raster order, so the root of a region is
+// still its first label. The bands are then joined by uniting the labels
+// on both sides of each border.
+
+// Minimum band size (in pixels) for parallel segmentation
+#define SEGMENTATION_MIN_BAND (1 << 16)
+
+struct segBand {
+  uint32 v0, v1;    // rows [v0, v1)
+  UnionFind uf;     // band-local labels
+  uint32* first;    // labels of row v0
+  uint32* last;     // labels of row v1-1
+  uint32 offset;    // first global label of the band
+  uint64_t pixmem;  // local instrumentation count
+};
+
+struct segmentation {
+  Image img;
+  struct segBand* bands;
+  uint32* parent;  // global labels (see UFResolveLabels)
+};
+
+// Label the rows of band b and record the labels of its first and last
+// row. If pass2, replay the labels instead and write the final ones.
+static void SegmentBand(struct segmentation* seg, int b, int pass2) {
+  Image img = seg->img;
+  struct segBand* band = &seg->bands[b];
+  uint32 w = img->width;
+  uint32* prev = malloc(w * sizeof(uint32));
+  uint32* cur = malloc(w * sizeof(uint32));
+  check(prev != NULL && cur != NULL, "Alloc failed ->label rows");
+  uint32 next = 0;
+  const uint32* final = pass2 ? seg->parent + band->offset : NULL;
+
+  for (uint32 x = 0; x < w; x++) prev[x] = NO_LABEL;
+  for (uint32 y = band->v0; y < band->v1; y++) {
+    uint16* row = img->image[y];
+    for (uint32 x = 0; x < w; x++) {
+      if (row[x] != WHITE) {
+        cur[x] = NO_LABEL;
+      } else if (!pass2) {
+        cur[x] = ProvisionalLabel(&band->uf, NULL, prev, cur, x);
+      } else {
+        cur[x] = ProvisionalLabel(NULL, &next, prev, cur, x);
+        row[x] = (uint16)final[cur[x]];
+        band->pixmem++;
+      }
+    }
+    band->pixmem += w;
+    if (!pass2 && y == band->v0) memcpy(band->first, cur, w * sizeof(uint32));
+    if (!pass2 && y + 1 == band->v1) memcpy(band->last, cur, w * sizeof(uint32));
+    uint32* tmp = prev;
+    prev = cur;
+    cur = tmp;
+  }
+  assert(!pass2 || next == band->uf.size);
+
+  free(prev);
+  free(cur);
+}
+
+static void SegmentBandPass1(void* arg, int b) { SegmentBand(arg, b, 0); }
+
+static void SegmentBandPass2(void* arg, int b) { SegmentBand(arg, b, 1); }
+
+// Copy the labels of band b to the global array.
+// (The labels across the band borders are united by SegmentBandBorder.)
+static void SegmentBandCopy(void* arg, int b) {
+  struct segmentation* seg = arg;
+  struct segBand* band = &seg->bands[b];
+  uint32 off = band->offset;
+  for (uint32 i = 0; i < band->uf.size; i++) {
+    seg->parent[off + i] = off + band->uf.parent[i];
+  }
+}
+
+static void SegmentBandBorder(void* arg, int b) {
+  struct segmentation* seg = arg;
+  const struct segBand* above = &seg->bands[b - 1];
+  const struct segBand* below = &seg->bands[b];
+  for (uint32 x = 0; x < seg->img->width; x++) {
+    if (above->last[x] != NO_LABEL && below->first[x] != NO_LABEL) {
+      UFUnionAtomic(seg->parent, above->offset + above->last[x],
+                    below->offset + below->first[x]);
+    }
+  }
+}
+
+static void SegmentBandBorderTask(void* arg, int task) {
+  SegmentBandBorder(arg, task + 1);
+}
+
+/// Label each WHITE region with a different color, using two-pass
+/// connected-component labeling.
+int ImageSegmentationUnionFind(Image img) {
+  assert(img != NULL);
+
+  uint32 w = img->width;
+  uint32 h = img->height;
+  if (w == 0 || h == 0) return 0;
+
+  int nbands = NumBands((uint64_t)w * h, SEGMENTATION_MIN_BAND);
+  if ((uint32)nbands > h) nbands = (int)h;
+  struct segBand bands[nbands];  // using VLAs...
+  struct segmentation seg = {img, bands, NULL};
+  for (int b = 0; b < nbands; b++) {
+    bands[b].v0 = BandStart(h, nbands, b);
+    bands[b].v1 = BandStart(h, nbands, b + 1);
+    bands[b].uf = (UnionFind){NULL, 0, 0};
+    bands[b].first = malloc(w * sizeof(uint32));
+    bands[b].last = malloc(w * sizeof(uint32));
+    check(bands[b].first != NULL && bands[b].last != NULL,
+          "Alloc failed ->band borders");
+    bands[b].pixmem = 0;
+  }
+
+  // Pass 1: provisional labels and their equivalences, band by band
+  ParallelRun(nbands, SegmentBandPass1, &seg);
+
+  // Join the bands into one set of global labels
+  uint64_t total = 0;
+  for (int b = 0; b < nbands; b++) {
+    bands[b].offset = (uint32)total;
+    total += bands[b].uf.size;
+  }
+  assert(total < NO_LABEL);
+  seg.parent = malloc((total > 0 ? total : 1) * sizeof(uint32));
+  check(seg.parent != NULL, "Alloc failed ->union-find");
+  ParallelRun(nbands, SegmentBandCopy, &seg);
+  if (nbands > 1) ParallelRun(nbands - 1, SegmentBandBorderTask, &seg);
+
+  // Final labels, in the order the regions are first met
+  UnionFind uf = {seg.parent, (uint32)total, (uint32)total};
+  int regions = UFResolveLabels(&uf, img->num_colors);
+
+  // Pass 2: replay the provisional labels and write the final ones
+  ParallelRun(nbands, SegmentBandPass2, &seg);
+
+  // Colors for the new labels
+  rgb_t color = 0;
+  for (int r = 0; r < regions; r++) {
+    color = GenerateNextColor(color);
+    img->LUT[img->num_colors++] = color;
+  }
+
+  for (int b = 0; b < nbands; b++) {
+    PIXMEM += bands[b].pixmem;
+    free(bands[b].uf.parent);
+    free(bands[b].first);
+    free(bands[b].last);
+  }
+  free(seg.parent);
+  return regions;
+}
+
+// Run-length labeling
+//
+// The WHITE pixels of each row are grouped in runs, and the runs are the
+// units of labeling: a run gets the provisional label of the first run it
+// touches in the row above (uniting it with the others it touches), or a
+// new label. Runs are numbered in raster order, so the root of a region is
+// still its first label.
+
+// A run of WHITE pixels [x0, x1) of some row, with its label
+typedef struct {
+  uint32 x0, x1;
+  uint32 label;
+} PixelRun;
+
+// The runs of an image, row by row
+typedef struct {
+  PixelRun* runs;
+  uint32 size;
+  uint32 capacity;
+  uint32* row_start;  // runs of row y are [row_start[y], row_start[y+1])
+} RunTable;
+
+static void RunTablePush(RunTable* t, uint32 x0, uint32 x1, uint32 label) {
+  if (t->size == t->capacity) {
+    t->capacity = t->capacity == 0 ? 1024 : 2 * t->capacity;
+    PixelRun* runs = realloc(t->runs, t->capacity * sizeof(PixelRun));
+    check(runs != NULL, "Alloc failed ->runs");
+    t->runs = runs;
+  }
+  t->runs[t->size++] = (PixelRun){x0, x1, label};
+}
+
+// Find the WHITE runs of img and give them provisional labels in uf.
+static void LabelRuns(const Image img, RunTable* t, UnionFind* uf) {
+  uint32 w = img->width;
+  t->row_start = malloc((img->height + 1) * sizeof(uint32));
+  check(t->row_start != NULL, "Alloc failed ->row_start");
+
+  for (uint32 y = 0; y < img->height; y++) {
+    const uint16* row = img->image[y];
+    t->row_start[y] = t->size;
+    // Runs of the row above, scanned along with the runs of this row
+    uint32 k = y > 0 ? t->row_start[y - 1] : 0;
+    uint32 kend = t->size;
+
+    uint32 x = RowFind(row, 0, w, WHITE);
+    while (x < w) {
+      uint32 end = RowRunEnd(row, x, w, WHITE);
+      // Skip the runs above that end before this one starts
+      while (k < kend && t->runs[k].x1 <= x) k++;
+      uint32 label = NO_LABEL;
+      // Runs above that overlap [x, end)
+      for (uint32 j = k; j < kend && t->runs[j].x0 < end; j++) {
+        if (label == NO_LABEL) {
+          label = t->runs[j].label;
+        } else if (t->runs[j].label != label) {
+          UFUnion(uf, label, t->runs[j].label);
+        }
+      }
+      if (label == NO_LABEL) label = UFNew(uf);
+      RunTablePush(t, x, end, label);
+      x = RowFind(row, end, w, WHITE);
+    }
+    PIXMEM += w;
+  }
+  t->row_start[img->height] = t->size;
+}
+
+// Label the WHITE regions of img by runs. If regions != NULL, also
+// build the descriptors of the labeled regions (in label order) from the
+// runs, while they are filled, and return them in *regions.
+static int SegmentRuns(Image img, RegionInfo** regions) {
+  RunTable t = {NULL, 0, 0, NULL};
+  UnionFind uf = {NULL, 0, 0};
+  LabelRuns(img, &t, &uf);
+
+  // Final labels, in the order the regions are first met
+  uint16 first = img->num_colors;
+  int nregions = UFResolveLabels(&uf, first);
+
+  RegionInfo* info = NULL;
+  uint64_t* sums = NULL;  // sums of u and v of each region, for centroids
+  if (regions != NULL && nregions > 0) {
+    info = calloc((size_t)nregions, sizeof(RegionInfo));
+    sums = calloc(2 * (size_t)nregions, sizeof(uint64_t));
+    check(info != NULL && sums != NULL, "Alloc failed ->region info");
+  }
+
+  // Fill each run with its final label
+  for (uint32 y = 0; y < img->height; y++) {
+    uint16* row = img->image[y];
+    for (uint32 r = t.row_start[y]; r < t.row_start[y + 1]; r++) {
+      uint32 x0 = t.runs[r].x0;
+      uint32 x1 = t.runs[r].x1;
+      uint16 label = (uint16)uf.parent[t.runs[r].label];
+      for (uint32 x = x0; x < x1; x++) row[x] = label;
+      PIXMEM += x1 - x0;
+
+      if (info == NULL || label == WHITE) continue;
+      RegionInfo* ri = &info[label - first];
+      uint64_t* sum = &sums[2 * (size_t)(label - first)];
+      if (ri->area == 0) {
+        // First run of the region: its first pixel is the seed
+        ri->label = label;
+        ri->seed_u = x0;
+        ri->seed_v = y;
+        ri->box = (LabelBox){x0, y, x1 - 1, y};
+      }
+      ri->area += x1 - x0;
+      sum[0] += ((uint64_t)x0 + x1 - 1) * (x1 - x0) / 2;
+      sum[1] += (uint64_t)y * (x1 - x0);
+      if (x0 < ri->box.umin) ri->box.umin = x0;
+      if (x1 - 1 > ri->box.umax) ri->box.umax = x1 - 1;
+      ri->box.vmax = y;
+    }
+  }
+
+  for (int i = 0; info != NULL && i < nregions; i++) {
+    info[i].cu = (double)sums[2 * i] / info[i].area;
+    info[i].cv = (double)sums[2 * i + 1] / info[i].area;
+  }
+  if (regions != NULL) *regions = info;
+
+  // Colors for the new labels
+  rgb_t color = 0;
+  for (int r = 0; r < nregions; r++) {
+    color = GenerateNextColor(color);
+    img->LUT[img->num_colors++] = color;
+  }
+
+  free(sums);
+  free(t.runs);
+  free(t.row_start);
+  free(uf.parent);
+  return nregions;
+}
+
+/// Label each WHITE region with a different color, using run-length
+/// connected-component labeling.
+int ImageSegmentationRuns(Image img) {
+  assert(img != NULL);
+  return SegmentRuns(img, NULL);
+}
+
+/// Label each WHITE region with a different color, and describe the
+/// regions.
+int ImageSegmentationWithStats(Image img, RegionInfo** regions) {
+  assert(img != NULL);
+  assert(regions != NULL);
+  return SegmentRuns(img, regions);
+}
+
+/// Incremental segmentation
+
+// State of an incremental segmentation.
+// Each search of a split (see SegmentationSplit) marks the pixels it
+// visits with its stamp, stamp_base + 1 + (search index), in mark.
+// (SegmentationErase marks the erased pixels with a stamp too.)
+struct segmentationState {
+  Image img;
+  uint32 area[FIXED_LUT_SIZE];   // pixels of each region label
+  uint16 free_labels[FIXED_LUT_SIZE];  // labels of erased regions
+  int num_free;
+  int regions;                   // number of regions
+  rgb_t last_color;              // color of the last new LUT entry
+  uint32* mark;                  // search stamps, one per pixel
+  uint32 stamp_base;
+  FillContext fill;              // workspace of the merges
+  uint16 saved_free[FIXED_LUT_SIZE];  // free_labels before a draw
+};
+
+// Labels state before a draw, to undo it (with saved_free)
+typedef struct {
+  int num_free;
+  int regions;
+  rgb_t last_color;
+  uint16 num_colors;
+} SegmentationSaved;
+
+/// Create an incremental segmentation of the BW image img.
+Segmentation SegmentationCreate(Image img) {
+  assert(img != NULL);
+  assert(img->num_colors <= 2);
+
+  Segmentation seg = calloc(1, sizeof(*seg));
+  check(seg != NULL, "Alloc failed ->segmentation");
+  seg->img = img;
+  size_t npixels = (size_t)img->width * img->height;
+  seg->mark = calloc(npixels > 0 ? npixels : 1, sizeof(uint32));
+  check(seg->mark != NULL, "Alloc failed ->segmentation marks");
+  seg->fill = FillContextCreate();
+
+  // ImageSegmentationRuns numbers the colors from GenerateNextColor(0)
+  seg->regions = ImageSegmentationRuns(img);
+  for (int r = 0; r < seg->regions; r++) {
+    seg->last_color = GenerateNextColor(seg->last_color);
+  }
+  ImageLabelHistogram(img, seg->area, NULL);
+  if (seg->area[WHITE] > 0) {
+    // Regions past the LUT were left WHITE
+    SegmentationDestroy(&seg);
+  }
+  return seg;
+}
+
+/// Destroy the segmentation pointed to by (*segp).
+void SegmentationDestroy(Segmentation* segp) {
+  assert(segp != NULL);
+  Segmentation seg = *segp;
+  if (seg == NULL) return;
+  free(seg->mark);
+  FillContextDestroy(&seg->fill);
+  free(seg);
+  *segp = NULL;
+}
+
+/// Get the number of regions.
+int SegmentationRegions(const Segmentation seg) {
+  assert(seg != NULL);
+  return seg->regions;
+}
+
+/// Get the number of pixels of the region with the given label.
+uint32 SegmentationArea(const Segmentation seg, uint16 label) {
+  assert(seg != NULL);
+  assert(label < FIXED_LUT_SIZE);
+  return label == BLACK ? 0 : seg->area[label];
+}
+
+// Number of labels left for new regions.
+static int SegmentationLabelsLeft(const Segmentation seg) {
+  return seg->num_free + FIXED_LUT_SIZE - seg->img->num_colors;
+}
+
+// Get a label for a new region: a freed one, or a new LUT entry.
+// Returns BLACK if the LUT is full.
+static uint16 SegmentationNewLabel(Segmentation seg) {
+  if (SegmentationLabelsLeft(seg) == 0) return BLACK;
+  seg->regions++;
+  if (seg->num_free > 0) return seg->free_labels[--seg->num_free];
+  Image img = seg->img;
+  seg->last_color = GenerateNextColor(seg->last_color);
+  img->LUT[img->num_colors] = seg->last_color;
+  return img->num_colors++;
+}
+
+static void SegmentationFreeLabel(Segmentation seg, uint16 label) {
+  assert(seg->area[label] == 0);
+  seg->regions--;
+  seg->free_labels[seg->num_free++] = label;
+}
+
+// Get the pixel with linear index p.
+static inline uint16* SegmentationPixel(Segmentation seg, PixelIndex p) {
+  uint32 w = seg->img->width;
+  return &seg->img->image[PixelIndexGetV(p, w)][PixelIndexGetU(p, w)];
+}
+
+// Reserve k stamps, stamp_base + 1 .. stamp_base + k, and return the base.
+static uint32 SegmentationStamps(Segmentation seg, uint32 k) {
+  if (seg->stamp_base > UINT32_MAX - k - 1) {
+    size_t npixels = (size_t)seg->img->width * seg->img->height;
+    memset(seg->mark, 0, npixels * sizeof(uint32));
+    seg->stamp_base = 0;
+  }
+  uint32 base = seg->stamp_base;
+  seg->stamp_base += k;
+  return base;
+}
+
+// Find the group (root search) of search i.
+static uint32 SearchGroup(uint32* group, uint32 i) {
+  while (group[i] != i) {
+    group[i] = group[group[i]];
+    i = group[i];
+  }
+  return i;
+}
+
+// Split region label, after some of its pixels were drawn BLACK, into its
+// connected pieces. seeds are the pixels of the region next to the drawn
+// pixels: every new piece holds at least one of them.
+//
+// A BFS is run from each seed, one step of each at a time. Searches that
+// meet are grouped (they are in the same piece). A group whose searches
+// all run out of pixels has visited a whole piece, which gets a new label.
+// The splitting stops when a single group is left, whose piece keeps the
+// old label: the cost is the size of the pieces that are split off (times
+// the number of seeds), not the size of the region. Only the searches
+// with pixels left are stepped, so finished ones cost nothing.
+//
+// Each relabeled pixel is appended to undo, followed by label.
+// Returns the number of relabeled pixels, or SEGMENTATION_LUT_FULL if a
+// piece got no label (the pieces split off before it keep theirs).
+static uint32 SegmentationSplit(Segmentation seg, uint16 label,
+                                const PixelIndex seeds[], uint32 k,
+                                IndexBuffer* undo) {
+  Image img = seg->img;
+  uint32 w = img->width;
+  uint32 h = img->height;
+
+  uint32 base = SegmentationStamps(seg, k);
+
+  IndexBuffer* visited = calloc(k, sizeof(IndexBuffer));
+  uint32* head = calloc(k, sizeof(uint32));  // BFS queue: visited[head..]
+  uint32* group = malloc(k * sizeof(uint32));
+  uint32* next = malloc(k * sizeof(uint32));     // circular list of a group
+  uint32* pending = malloc(k * sizeof(uint32));  // of a group: searches left
+  uint32* active = malloc(k * sizeof(uint32));   // searches with pixels left
+  check(visited != NULL && head != NULL && group != NULL && next != NULL &&
+            pending != NULL && active != NULL,
+        "Alloc failed ->split searches");
+
+  uint32 nactive = 0;
+  uint32 live = 0;  // groups not retired
+  for (uint32 i = 0; i < k; i++) {
+    uint32 m = seg->mark[seeds[i]];
+    if (m > base && m <= base + k) continue;  // repeated seed
+    seg->mark[seeds[i]] = base + 1 + i;
+    IndexBufferPush(&visited[i], seeds[i]);
+    group[i] = next[i] = i;
+    pending[i] = 1;
+    active[nactive++] = i;
+    live++;
+  }
+
+  uint32 relabeled = 0;
+  while (live > 1) {
+    assert(nactive > 0);
+    for (uint32 a = 0; a < nactive && live > 1;) {
+      // One BFS step of search i
+      uint32 i = active[a];
+      PixelIndex p = visited[i].items[head[i]++];
+      uint32 x = (uint32)PixelIndexGetU(p, w);
+      uint32 y = (uint32)PixelIndexGetV(p, w);
+      PixelIndex neighbors[4];
+      int nn = 0;
+      if (x + 1 < w) neighbors[nn++] = p + 1;
+      if (x > 0) neighbors[nn++] = p - 1;
+      if (y + 1 < h) neighbors[nn++] = p + w;
+      if (y > 0) neighbors[nn++] = p - w;
+      for (int j = 0; j < nn; j++) {
+        PixelIndex q = neighbors[j];
+        PIXMEM++;
+        if (*SegmentationPixel(seg, q) != label) continue;
+        uint32 m = seg->mark[q];
+        if (m > base && m <= base + k) {
+          // Met another search: same piece
+          uint32 g1 = SearchGroup(group, i);
+          uint32 g2 = SearchGroup(group, m - base - 1);
+          if (g1 == g2) continue;
+          if (g2 < g1) {
+            uint32 t = g1;
+            g1 = g2;
+            g2 = t;
+          }
+          group[g2] = g1;
+          pending[g1] += pending[g2];
+          uint32 rest = next[g1];  // join the lists
+          next[g1] = next[g2];
+          next[g2] = rest;
+          live--;
+        } else {
+          seg->mark[q] = base + 1 + i;
+          IndexBufferPush(&visited[i], q);
+        }
+      }
+      if (head[i] < visited[i].size) {
+        a++;
+        continue;
+      }
+
+      // Search i ran out of pixels: swap in the last one
+      active[a] = active[--nactive];
+      uint32 g = SearchGroup(group, i);
+      if (--pending[g] > 0 || live <= 1) continue;
+
+      // Its whole group did: a whole piece, give it a new label
+      uint16 new_label = SegmentationNewLabel(seg);
+      if (new_label == BLACK) {
+        relabeled = SEGMENTATION_LUT_FULL;
+        goto done;
+      }
+      uint32 s = g;
+      do {
+        for (uint32 j = 0; j < visited[s].size; j++) {
+          *SegmentationPixel(seg, visited[s].items[j]) = new_label;
+          IndexBufferPush(undo, visited[s].items[j]);
+          IndexBufferPush(undo, label);
+        }
+        seg->area[new_label] += (uint32)visited[s].size;
+        PIXMEM += visited[s].size;
+        s = next[s];
+      } while (s != g);
+      seg->area[label] -= seg->area[new_label];
+      relabeled += seg->area[new_label];
+      live--;
+    }
+  }
+
+done:
+  for (uint32 i = 0; i < k; i++) free(visited[i].items);
+  free(visited);
+  free(head);
+  free(group);
+  free(next);
+  free(pending);
+  free(active);
+  return relabeled;
+}
+
+// Save the labels state before a draw.
+static void SegmentationSave(Segmentation seg, SegmentationSaved* saved) {
+  saved->num_free = seg->num_free;
+  saved->regions = seg->regions;
+  saved->last_color = seg->last_color;
+  saved->num_colors = seg->img->num_colors;
+  memcpy(seg->saved_free, seg->free_labels, seg->num_free * sizeof(uint16));
+}
+
+// Undo a draw: restore the pixels in undo (each followed by its previous
+// label), latest change first, with their areas, and the labels state.
+// (The stamps are not restored: they are in the marks already.)
+static void SegmentationRestore(Segmentation seg,
+                                const SegmentationSaved* saved,
+                                const IndexBuffer* undo) {
+  for (size_t i = undo->size; i > 0; i -= 2) {
+    uint16* pixel = SegmentationPixel(seg, undo->items[i - 2]);
+    uint16 old = (uint16)undo->items[i - 1];
+    if (*pixel != BLACK) seg->area[*pixel]--;
+    if (old != BLACK) seg->area[old]++;
+    *pixel = old;
+  }
+  PIXMEM += undo->size / 2;
+  seg->num_free = saved->num_free;
+  seg->regions = saved->regions;
+  seg->last_color = saved->last_color;
+  seg->img->num_colors = saved->num_colors;
+  memcpy(seg->free_labels, seg->saved_free, seg->num_free * sizeof(uint16));
+}
+
+// Draw pixels BLACK, then split the regions they cut.
+// If a piece gets no label, the draw is undone.
+static uint32 SegmentationDraw(Segmentation seg, const PixelCoords pixels[],
+                               int n) {
+  Image img = seg->img;
+  uint32 w = img->width;
+  uint32 h = img->height;
+  uint32 changed = 0;
+
+  // To undo: the labels state, and the changed pixels, each followed by
+  // its previous label
+  SegmentationSaved saved;
+  SegmentationSave(seg, &saved);
+  IndexBuffer undo = {NULL, 0, 0};
+
+  // Region pixels next to the drawn pixels, to seed the splits
+  IndexBuffer seeds = {NULL, 0, 0};
+  for (int i = 0; i < n; i++) {
+    int u = PixelCoordsGetU(pixels[i]);
+    int v = PixelCoordsGetV(pixels[i]);
+    assert(ImageIsValidPixel(img, u, v));
+    uint16 label = img->image[v][u];
+    PIXMEM++;
+    if (label == BLACK) continue;
+    img->image[v][u] = BLACK;
+    PIXMEM++;
+    changed++;
+    if (--seg->area[label] == 0) SegmentationFreeLabel(seg, label);
+    PixelIndex p = PixelIndexCreate(w, u, v);
+    IndexBufferPush(&undo, p);
+    IndexBufferPush(&undo, label);
+    if ((uint32)u + 1 < w) IndexBufferPush(&seeds, p + 1);
+    if (u > 0) IndexBufferPush(&seeds, p - 1);
+    if ((uint32)v + 1 < h) IndexBufferPush(&seeds, p + w);
+    if (v > 0) IndexBufferPush(&seeds, p - w);
+  }
+
+  // Split each cut region, with the seeds still in it
+  uint8 done[FIXED_LUT_SIZE] = {0};
+  IndexBuffer region_seeds = {NULL, 0, 0};
+  for (size_t i = 0; i < seeds.size; i++) {
+    uint16 label = *SegmentationPixel(seg, seeds.items[i]);
+    if (label == BLACK || done[label]) continue;
+    done[label] = 1;
+    region_seeds.size = 0;
+    for (size_t j = i; j < seeds.size; j++) {
+      if (*SegmentationPixel(seg, seeds.items[j]) == label) {
+        IndexBufferPush(&region_seeds, seeds.items[j]);
+      }
+    }
+    PIXMEM += seeds.size - i;
+    if (region_seeds.size > 1) {
+      uint32 relabeled = SegmentationSplit(seg, label, region_seeds.items,
+                                           (uint32)region_seeds.size, &undo);
+      if (relabeled == SEGMENTATION_LUT_FULL) {
+        changed = SEGMENTATION_LUT_FULL;
+        break;
+      }
+      changed += relabeled;
+    }
+  }
+
+  if (changed == SEGMENTATION_LUT_FULL) {
+    SegmentationRestore(seg, &saved, &undo);
+  }
+
+  free(seeds.items);
+  free(region_seeds.items);
+  free(undo.items);
+  return changed;
+}
+
+// Erase pixels (make them WHITE background), merging the regions they
+// join: the largest region keeps its label, the others are relabeled.
+// If the LUT has too few labels for the new regions, nothing is erased.
+static uint32 SegmentationErase(Segmentation seg, const PixelCoords pixels[],
+                                int n) {
+  Image img = seg->img;
+  uint32 w = img->width;
+  uint32 changed = 0;
+
+  // An erased pixel with no region around it, nor an erased pixel before
+  // it, starts a new region. Count them before any change. (Labels freed
+  // by the merges are not counted, so the erasing cannot run out midway.)
+  uint32 stamp = SegmentationStamps(seg, 1) + 1;
+  int needed = 0;
+  for (int i = 0; i < n; i++) {
+    int u = PixelCoordsGetU(pixels[i]);
+    int v = PixelCoordsGetV(pixels[i]);
+    assert(ImageIsValidPixel(img, u, v));
+    PixelIndex p = PixelIndexCreate(w, u, v);
+    PIXMEM++;
+    if (img->image[v][u] != BLACK || seg->mark[p] == stamp) continue;
+    seg->mark[p] = stamp;
+    int nu[4] = {u + 1, u - 1, u, u};
+    int nv[4] = {v, v, v + 1, v - 1};
+    int isolated = 1;
+    for (int j = 0; j < 4; j++) {
+      if (!ImageIsValidPixel(img, nu[j], nv[j])) continue;
+      PIXMEM++;
+      if (img->image[nv[j]][nu[j]] != BLACK ||
+          seg->mark[PixelIndexCreate(w, nu[j], nv[j])] == stamp) {
+        isolated = 0;
+      }
+    }
+    needed += isolated;
+  }
+  if (needed > SegmentationLabelsLeft(seg)) return SEGMENTATION_LUT_FULL;
+
+  for (int i = 0; i < n; i++) {
+    int u = PixelCoordsGetU(pixels[i]);
+    int v = PixelCoordsGetV(pixels[i]);
+    assert(ImageIsValidPixel(img, u, v));
+    PIXMEM++;
+    if (img->image[v][u] != BLACK) continue;
+
+    // Neighboring regions, and the largest of them
+    int nu[4] = {u + 1, u - 1, u, u};
+    int nv[4] = {v, v, v + 1, v - 1};
+    uint16 largest = BLACK;
+    for (int j = 0; j < 4; j++) {
+      if (!ImageIsValidPixel(img, nu[j], nv[j])) continue;
+      uint16 l = img->image[nv[j]][nu[j]];
+      PIXMEM++;
+      if (l != BLACK &&
+          (largest == BLACK || seg->area[l] > seg->area[largest])) {
+        largest = l;
+      }
+    }
+
+    uint16 label = largest != BLACK ? largest : SegmentationNewLabel(seg);
+    assert(label != BLACK);
+    img->image[v][u] = label;
+    PIXMEM++;
+    seg->area[label]++;
+    changed++;
+
+    // Merge the other neighboring regions into it
+    for (int j = 0; j < 4; j++) {
+      if (!ImageIsValidPixel(img, nu[j], nv[j])) continue;
+      uint16 l = img->image[nv[j]][nu[j]];
+      if (l == BLACK || l == label) continue;
+      int count =
+          ImageRegionFillingScanlineCtx(seg->fill, img, nu[j], nv[j], label);
+      seg->area[label] += (uint32)count;
+      seg->area[l] -= (uint32)count;
+      changed += (uint32)count;
+      SegmentationFreeLabel(seg, l);
+    }
+  }
+  return changed;
+}
+
+/// Draw (value == BLACK) or erase (value == WHITE) n pixels, and update
+/// the regions.
+uint32 SegmentationUpdate(Segmentation seg, const PixelCoords pixels[], int n,
+                          uint16 value) {
+  assert(seg != NULL);
+  assert(n >= 0);
+  assert(n == 0 || pixels != NULL);
+  assert(value == BLACK || value == WHITE);
+  return value == BLACK ? SegmentationDraw(seg, pixels, n)
+                        : SegmentationErase(seg, pixels, n);
+}
+
+/// Streaming segmentation
+
+// Open the PBM file filename and read its header.
+static FILE* StreamOpenPBM(const char* filename, uint32* width,
+                           uint32* height) {
+  int w, h;
+  char c;
+  FILE* f = NULL;
+
+  check((f = fopen(filename, "rb")) != NULL, "Open failed");
+  check(fscanf(f, "P%c ", &c) == 1 && c == '4', "Invalid file format");
+  skipComments(f);
+  check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width");
+  skipComments(f);
+  check(fscanf(f, "%d", &h) == 1 && h >= 0, "Invalid height");
+  check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
+  *width = (uint32)w;
+  *height = (uint32)h;
+  return f;
+}
+
+// The relabel file of the streaming segmentation: one uint32 record per
+// provisional label. Records are read and written a page at a time,
+// through a few pages cached in memory (least recently used goes first).
+// The records of a page not yet in the file are 0.
+#define RELABEL_PAGE 4096  // records per page
+#define RELABEL_CACHED 8   // pages in memory
+
+typedef struct {
+  FILE* f;
+  uint32 pages;                   // pages in the file
+  uint32 page[RELABEL_CACHED];    // page in each buffer, or NO_LABEL
+  uint8 dirty[RELABEL_CACHED];
+  uint32 last_use[RELABEL_CACHED];
+  uint32 clock;
+  uint32 data[RELABEL_CACHED][RELABEL_PAGE];
+} RelabelFile;
+
+static RelabelFile* RelabelCreate(void) {
+  RelabelFile* r = malloc(sizeof(RelabelFile));
+  check(r != NULL, "Alloc failed ->relabel file");
+  check((r->f = tmpfile()) != NULL, "Open failed");
+  r->pages = 0;
+  r->clock = 0;
+  for (int i = 0; i < RELABEL_CACHED; i++) {
+    r->page[i] = NO_LABEL;
+    r->dirty[i] = 0;
+    r->last_use[i] = 0;
+  }
+  return r;
+}
+
+static void RelabelDestroy(RelabelFile* r) {
+  fclose(r->f);
+  free(r);
+}
+
+// Get the record of label, loading its page if needed.
+static uint32* RelabelRecord(RelabelFile* r, uint32 label, int write) {
+  uint32 page = label / RELABEL_PAGE;
+  int i = 0;
+  for (int j = 0; j < RELABEL_CACHED; j++) {
+    if (r->page[j] == page) {
+      i = j;
+      goto found;
+    }
+    if (r->last_use[j] < r->last_use[i]) i = j;
+  }
+
+  // Evict buffer i, then load the page into it
+  long size = RELABEL_PAGE * sizeof(uint32);
+  if (r->dirty[i]) {
+    check(fseek(r->f, (long)r->page[i] * size, SEEK_SET) == 0 &&
+              fwrite(r->data[i], size, 1, r->f) == 1,
+          "Writing relabel file failed");
+    if (r->page[i] >= r->pages) r->pages = r->page[i] + 1;
+  }
+  if (page < r->pages) {
+    check(fseek(r->f, (long)page * size, SEEK_SET) == 0 &&
+              fread(r->data[i], size, 1, r->f) == 1,
+          "Reading relabel file failed");
+  } else {
+    memset(r->data[i], 0, size);
+  }
+  r->page[i] = page;
+  r->dirty[i] = 0;
+
+found:
+  r->last_use[i] = ++r->clock;
+  r->dirty[i] |= write;
+  return &r->data[i][label % RELABEL_PAGE];
+}
+
+// Sets of provisional labels, for the streaming segmentation.
+//
+// Only the sets with labels in the current row are kept, in slots: the
+// labels of a row are slot numbers, linked by parent, and id is the oldest
+// provisional label of each slot (the root label of its set). At the end of
+// each row the slots are compacted to the roots in the row.
+//
+// The union-find of the provisional labels themselves is written to the
+// relabel file, one uint32 record per label: a label gets its parent when
+// its set joins an older one, or itself when its set closes (no pixel in
+// the row) as a root. Parents are older labels, so resolving the records
+// in order gives the final labels (as UFResolveLabels does).
+typedef struct {
+  uint32* parent;
+  uint32* id;
+  uint32* map;   // compaction: new slot of each root slot
+  uint32 size;   // slots in use, at most width + 1
+  uint32 next;   // next provisional label
+  uint32 peak;   // largest size reached
+  RelabelFile* relabel;
+} StreamSets;
+
+// Largest number of sets kept by the last streaming segmentation
+static uint32 stream_peak_sets = 0;
+
+static uint32 StreamFind(StreamSets* sets, uint32 x) {
+  uint32* parent = sets->parent;
+  while (parent[x] != x) {
+    parent[x] = parent[parent[x]];
+    x = parent[x];
+  }
+  return x;
+}
+
+// Unite the sets of slots a and b: the younger root joins the older.
+static void StreamUnion(StreamSets* sets, uint32 a, uint32 b) {
+  a = StreamFind(sets, a);
+  b = StreamFind(sets, b);
+  if (a == b) return;
+  if (sets->id[a] > sets->id[b]) {
+    uint32 t = a;
+    a = b;
+    b = t;
+  }
+  sets->parent[b] = a;
+  *RelabelRecord(sets->relabel, sets->id[b], 1) = sets->id[a];
+}
+
+// End of a row of slots cur: close the sets not in it and compact the
+// others, renumbering cur.
+static void StreamCloseRow(StreamSets* sets, uint32* cur, uint32 w) {
+  if (sets->size > sets->peak) sets->peak = sets->size;
+  for (uint32 s = 0; s < sets->size; s++) sets->map[s] = NO_LABEL;
+  for (uint32 x = 0; x < w; x++) {
+    if (cur[x] != NO_LABEL) sets->map[StreamFind(sets, cur[x])] = 0;
+  }
+  // The roots in the row keep their order, so slot s moves down to
+  // map[s] <= s, after the slots below it were read
+  uint32 size = 0;
+  for (uint32 s = 0; s < sets->size; s++) {
+    if (sets->parent[s] != s) continue;
+    if (sets->map[s] == NO_LABEL) {
+      *RelabelRecord(sets->relabel, sets->id[s], 1) = sets->id[s];
+    } else {
+      sets->map[s] = size;
+      sets->id[size++] = sets->id[s];
+    }
+  }
+  for (uint32 x = 0; x < w; x++) {
+    if (cur[x] != NO_LABEL) cur[x] = sets->map[StreamFind(sets, cur[x])];
+  }
+  for (uint32 s = 0; s < size; s++) sets->parent[s] = s;
+  sets->size = size;
+}
+
+// One streaming pass over the PBM file infile, band_rows rows at a time.
+// Pass 1 (sets != NULL) gives provisional labels to the WHITE pixels and
+// writes their sets to the relabel file (see StreamSets). Pass 2 replays
+// the same labels, reading their final labels from the relabel file in
+// order, and writes each row to the PPM file out, with their colors.
+static void StreamSegmentationPass(const char* infile, uint32 band_rows,
+                                   StreamSets* sets, RelabelFile* relabel,
+                                   FILE* out, const rgb_t colors[]) {
+  uint32 w, h;
+  FILE* f = StreamOpenPBM(infile, &w, &h);
+  if (out != NULL) {
+    check(fprintf(out, "P3\n%u %u\n255\n", w, h) > 0,
+          "Writing header failed");
+  }
+
+  size_t nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
+  uint8* band = malloc((nbytes > 0 ? nbytes : 1) * band_rows);
+  uint8* raw_row = malloc(nbytes * 8 + 1);
+  uint32* prev = malloc((w > 0 ? w : 1) * sizeof(uint32));
+  uint32* cur = malloc((w > 0 ? w : 1) * sizeof(uint32));
+  check(band != NULL && raw_row != NULL && prev != NULL && cur != NULL,
+        "Alloc failed ->stream buffers");
+
+  uint32 next = 0;  // next provisional label (pass 2)
+  for (uint32 x = 0; x < w; x++) prev[x] = NO_LABEL;
+  for (uint32 y0 = 0; y0 < h; y0 += band_rows) {
+    uint32 n = h - y0 < band_rows ? h - y0 : band_rows;
+    check(fread(band, 1, nbytes * n, f) == nbytes * n, "Reading pixels");
+
+    for (uint32 i = 0; i < n; i++) {
+      unpackBits((int)nbytes, band + i * nbytes, raw_row);
+      // Slots (pass 1) or final labels (pass 2), as ProvisionalLabel does
+      for (uint32 x = 0; x < w; x++) {
+        uint32 left = x > 0 ? cur[x - 1] : NO_LABEL;
+        uint32 up = prev[x];
+        if (raw_row[x] != WHITE) {
+          cur[x] = NO_LABEL;
+        } else if (left == NO_LABEL && up == NO_LABEL) {
+          if (sets != NULL) {
+            uint32 slot = sets->size++;
+            sets->parent[slot] = slot;
+            sets->id[slot] = sets->next++;
+            cur[x] = slot;
+          } else {
+            cur[x] = *RelabelRecord(relabel, next++, 0);
+          }
+        } else if (left == NO_LABEL) {
+          cur[x] = up;
+        } else {
+          if (sets != NULL && up != NO_LABEL && up != left) {
+            StreamUnion(sets, left, up);
+          }
+          cur[x] = left;
+        }
+      }
+      PIXMEM += w;
+
+      if (sets != NULL) StreamCloseRow(sets, cur, w);
+      if (out != NULL) {
+        for (uint32 x = 0; x < w; x++) {
+          rgb_t color = colors[cur[x] == NO_LABEL ? BLACK : cur[x]];
+          fprintf(out, "  %3d %3d %3d", (int)(color >> 16 & 0xff),
+                  (int)(color >> 8 & 0xff), (int)(color & 0xff));
+        }
+        check(fprintf(out, "\n") > 0, "Writing pixels failed");
+      }
+      uint32* tmp = prev;
+      prev = cur;
+      cur = tmp;
+    }
+  }
+
+  if (sets != NULL) {
+    // Close the sets of the last row
+    for (uint32 x = 0; x < w; x++) cur[x] = NO_LABEL;
+    StreamCloseRow(sets, cur, w);
+  }
+
+  free(band);
+  free(raw_row);
+  free(prev);
+  free(cur);
+  fclose(f);
+}
+
+/// Segment a PBM file into a PPM file, streaming bands of rows.
+int ImageSegmentationStreamPBM(const char* infile, const char* outfile,
+                               uint32 band_rows) {
+  assert(infile != NULL);
+  assert(outfile != NULL);
+  assert(band_rows > 0);
+
+  uint32 w, h;
+  fclose(StreamOpenPBM(infile, &w, &h));
+
+  // Pass 1: provisional labels, and their sets in the relabel file
+  // (a row of w pixels starts at most (w + 1) / 2 sets, and keeps at most
+  // as many from the row above)
+  StreamSets sets = {NULL, NULL, NULL, 0, 0, 0, NULL};
+  sets.parent = malloc(((size_t)w + 2) * sizeof(uint32));
+  sets.id = malloc(((size_t)w + 2) * sizeof(uint32));
+  sets.map = malloc(((size_t)w + 2) * sizeof(uint32));
+  check(sets.parent != NULL && sets.id != NULL && sets.map != NULL,
+        "Alloc failed ->stream sets");
+  sets.relabel = RelabelCreate();
+  StreamSegmentationPass(infile, band_rows, &sets, NULL, NULL, NULL);
+  stream_peak_sets = sets.peak;
+  free(sets.parent);
+  free(sets.id);
+  free(sets.map);
+
+  // Final labels, as for an image with only the WHITE and BLACK colors
+  // (see UFResolveLabels): each record becomes the final label of its set
+  RelabelFile* relabel = sets.relabel;
+  uint32 next = 2;
+  for (uint32 label = 0; label < sets.next; label++) {
+    // (The page of record is the most recently used, so reading the
+    // parent record cannot evict it.)
+    uint32* record = RelabelRecord(relabel, label, 1);
+    if (*record != label) {
+      *record = *RelabelRecord(relabel, *record, 0);
+    } else {
+      *record = next < FIXED_LUT_SIZE ? next++ : WHITE;
+    }
+  }
+  int regions = (int)(next - 2);
+  rgb_t colors[FIXED_LUT_SIZE];
+  colors[WHITE] = 0xffffff;
+  colors[BLACK] = 0x000000;
+  rgb_t color = 0;
+  for (int r = 0; r < regions; r++) {
+    color = GenerateNextColor(color);
+    colors[2 + r] = color;
+  }
+
+  // Pass 2: replay the provisional labels and write the final colors
+  FILE* out = NULL;
+  check((out = fopen(outfile, "wb")) != NULL, "Open failed");
+  StreamSegmentationPass(infile, band_rows, NULL, relabel, out, colors);
+  fclose(out);
+  RelabelDestroy(relabel);
+  return regions;
+}
+
+/// Largest number of label sets kept by the last streaming segmentation.
+uint32 ImageSegmentationStreamPeakSets(void) { return stream_peak_sets; }
+
+/// Region adjacency
+
+// Two regions are adjacent if some row or column goes from one to the
+// other crossing at most thickness BLACK pixels. Each row is scanned once,
+// keeping, for the row and for each column, the last region label met and
+// the number of BLACK pixels since then.
+//
+// The rows are split into bands scanned in parallel. A band first scans
+// the thickness+1 rows above it (without reporting pairs) to know what the
+// columns hold at its first row. Each band marks the pairs it finds in its
+// own bit matrix, so repeated pairs cost nothing; the matrices are then
+// merged with OR and turned into the CSR arrays.
+
+// Minimum band size (in pixels) for parallel adjacency
+#define ADJACENCY_MIN_BAND (1 << 16)
+
+// Words of a bit matrix row, for n labels
+#define BITROW_WORDS(n) (((size_t)(n) + 63) / 64)
+
+struct adjacencyBand {
+  uint32 v0, v1;     // rows [v0, v1)
+  uint64_t* pairs;   // bit matrix: bit (a, b) set if a and b are adjacent
+  uint64_t pixmem;   // local instrumentation count
+};
+
+struct adjacency {
+  Image img;
+  uint32 thickness;
+  struct adjacencyBand* bands;
+};
+
+// Labels without a LUT entry (a or b >= n) are not reported.
+static inline void MarkPair(uint64_t* pairs, size_t words, uint32 n,
+                            uint16 a, uint16 b) {
+  if (a >= n || b >= n) return;
+  pairs[a * words + (b >> 6)] |= 1ull << (b & 63);
+  pairs[b * words + (a >> 6)] |= 1ull << (a & 63);
+}
+
+// Scan row y, pairing its regions with the last ones met before them in
+// the row and in their columns (if pairs != NULL).
+static void AdjacencyScanRow(const uint16* row, uint32 w, uint32 thickness,
+                             uint16* col_label, uint32* col_gap,
+                             uint64_t* pairs, size_t words, uint32 n) {
+  uint16 last = BLACK;  // no region yet in this row
+  uint32 gap = 0;
+  for (uint32 x = 0; x < w; x++) {
+    uint16 l = row[x];
+    if (l == BLACK) {
+      gap++;
+      col_gap[x]++;
+      continue;
+    }
+    if (pairs != NULL) {
+      if (last != BLACK && last != l && gap <= thickness) {
+        MarkPair(pairs, words, n, last, l);
+      }
+      if (col_label[x] != BLACK && col_label[x] != l &&
+          col_gap[x] <= thickness) {
+        MarkPair(pairs, words, n, col_label[x], l);
+      }
+    }
+    last = l;
+    gap = 0;
+    col_label[x] = l;
+    col_gap[x] = 0;
+  }
+}
+
+static void AdjacencyBandTask(void* arg, int b) {
+  struct adjacency* adj = arg;
+  struct adjacencyBand* band = &adj->bands[b];
+  Image img = adj->img;
+  uint32 w = img->width;
+  size_t words = BITROW_WORDS(img->num_colors);
+
+  uint16* col_label = malloc((w > 0 ? w : 1) * sizeof(uint16));
+  uint32* col_gap = malloc((w > 0 ? w : 1) * sizeof(uint32));
+  check(col_label != NULL && col_gap != NULL, "Alloc failed ->columns");
+  for (uint32 x = 0; x < w; x++) {
+    col_label[x] = BLACK;
+    col_gap[x] = 0;
+  }
+
+  // Rows above the band that can still pair with its first row
+  uint32 y = band->v0 > adj->thickness + 1 ? band->v0 - adj->thickness - 1 : 0;
+  for (; y < band->v0; y++) {
+    AdjacencyScanRow(img->image[y], w, adj->thickness, col_label, col_gap,
+                     NULL, words, img->num_colors);
+    band->pixmem += w;
+  }
+  for (; y < band->v1; y++) {
+    AdjacencyScanRow(img->image[y], w, adj->thickness, col_label, col_gap,
+                     band->pairs, words, img->num_colors);
+    band->pixmem += w;
+  }
+
+  free(col_label);
+  free(col_gap);
+}
+
+/// Build the region adjacency graph of img.
+RegionAdjacency* ImageRegionAdjacency(const Image img, uint32 thickness) {
+  assert(img != NULL);
+
+  uint32 n = img->num_colors;
+  size_t words = BITROW_WORDS(n);
+  uint32 h = img->height;
+
+  int nbands = NumBands((uint64_t)img->width * h, ADJACENCY_MIN_BAND);
+  if (h > 0 && (uint32)nbands > h) nbands = (int)h;
+  struct adjacencyBand bands[nbands];  // using VLAs...
+  struct adjacency adj = {img, thickness, bands};
+  for (int b = 0; b < nbands; b++) {
+    bands[b].v0 = BandStart(h, nbands, b);
+    bands[b].v1 = BandStart(h, nbands, b + 1);
+    bands[b].pairs = calloc(n * words + 1, sizeof(uint64_t));
+    check(bands[b].pairs != NULL, "Alloc failed ->pair matrix");
+    bands[b].pixmem = 0;
+  }
+  ParallelRun(nbands, AdjacencyBandTask, &adj);
+
+  // Merge the bands' pairs
+  uint64_t* pairs = bands[0].pairs;
+  for (int b = 1; b < nbands; b++) {
+    for (size_t i = 0; i < n * words; i++) pairs[i] |= bands[b].pairs[i];
+    free(bands[b].pairs);
+  }
+  for (int b = 0; b < nbands; b++) PIXMEM += bands[b].pixmem;
+
+  // CSR arrays, with the neighbors of each label in increasing order
+  RegionAdjacency* graph = malloc(sizeof(*graph));
+  check(graph != NULL, "Alloc failed ->adjacency");
+  graph->num_labels = n;
+  graph->offsets = malloc((n + 1) * sizeof(uint32));
+  check(graph->offsets != NULL, "Alloc failed ->offsets");
+  uint32 total = 0;
+  for (uint32 a = 0; a < n; a++) {
+    graph->offsets[a] = total;
+    for (size_t i = 0; i < words; i++) {
+      total += (uint32)__builtin_popcountll(pairs[a * words + i]);
+    }
+  }
+  graph->offsets[n] = total;
+  graph->neighbors = malloc((total > 0 ? total : 1) * sizeof(uint16));
+  check(graph->neighbors != NULL, "Alloc failed ->neighbors");
+  uint32 k = 0;
+  for (uint32 a = 0; a < n; a++) {
+    for (size_t i = 0; i < words; i++) {
+      uint64_t bits = pairs[a * words + i];
+      while (bits != 0) {
+        graph->neighbors[k++] = (uint16)(i * 64 + __builtin_ctzll(bits));
+        bits &= bits - 1;
+      }
+    }
+  }
+
+  free(pairs);
+  return graph;
+}
+
+/// Destroy the adjacency graph pointed to by (*graphp).
+void RegionAdjacencyDestroy(RegionAdjacency** graphp) {
+  assert(graphp != NULL);
+  RegionAdjacency* graph = *graphp;
+  if (graph == NULL) return;
+  free(graph->offsets);
+  free(graph->neighbors);
+  free(graph);
+  *graphp = NULL;
+}
+
+/// Region contours
+
+// Contours are traced along the cracks between pixels, from corner to
+// corner, keeping the region on the right-hand side: clockwise around the
+// region and counterclockwise around its holes. At each corner, with
+// pixels R (ahead, right) and L (ahead, left):
+//   R not in the region: turn right;
+//   R and L in the region: turn left (4-connectivity: L touches R);
+//   otherwise: go straight.
+
+// Corner offsets of each step direction (CHAIN_E, CHAIN_S, CHAIN_W, CHAIN_N)
+static const int chain_dx[4] = {1, 0, -1, 0};
+static const int chain_dy[4] = {0, 1, 0, -1};
+
+// Offsets, from corner (x, y), of the pixels ahead-right and ahead-left
+// when heading in each direction
+static const int ahead_right_dx[4] = {0, -1, -1, 0};
+static const int ahead_right_dy[4] = {0, 0, -1, -1};
+static const int ahead_left_dx[4] = {0, 0, -1, -1};
+static const int ahead_left_dy[4] = {-1, 0, 0, -1};
+
+static inline int InRegion(const Image img, uint16 label, int x, int y) {
+  PIXMEM++;
+  return ImageIsValidPixel(img, x, y) && img->image[y][x] == label;
+}
+
+static void ChainPush(ChainCode* c, uint32* capacity, int d) {
+  if (c->length / 4 == *capacity) {
+    *capacity = *capacity == 0 ? 64 : 2 * *capacity;
+    uint8* codes = realloc(c->codes, *capacity);
+    check(codes != NULL, "Alloc failed ->chain codes");
+    c->codes = codes;
+  }
+  if (c->length % 4 == 0) c->codes[c->length / 4] = 0;
+  c->codes[c->length / 4] |= (uint8)(d << (2 * (c->length % 4)));
+  c->length++;
+}
+
+// Trace the contour through corner (x, y) heading d, until this state
+// comes back. Updates the corner bounding box box, if not NULL.
+static void TraceContour(const Image img, uint16 label, int x, int y, int d,
+                         ChainCode* c, LabelBox* box) {
+  int sx = x, sy = y, sd = d;
+  uint32 capacity = 0;
+  c->u = (uint32)x;
+  c->v = (uint32)y;
+  c->length = 0;
+  c->codes = NULL;
+  do {
+    ChainPush(c, &capacity, d);
+    x += chain_dx[d];
+    y += chain_dy[d];
+    if (box != NULL) {
+      if ((uint32)x < box->umin) box->umin = (uint32)x;
+      if ((uint32)x > box->umax) box->umax = (uint32)x;
+      if ((uint32)y > box->vmax) box->vmax = (uint32)y;
+    }
+    if (!InRegion(img, label, x + ahead_right_dx[d], y + ahead_right_dy[d])) {
+      d = (d + 1) & 3;
+    } else if (InRegion(img, label, x + ahead_left_dx[d],
+                        y + ahead_left_dy[d])) {
+      d = (d + 3) & 3;
+    }
+  } while (x != sx || y != sy || d != sd);
+}
+
+// Step i of chain code c.
+static inline int ChainStep(const ChainCode* c, uint32 i) {
+  return (c->codes[i / 4] >> (2 * (i % 4))) & 3;
+}
+
+// Mark, in traced, the westward steps of c (the tops of the pixels below
+// them), with traced indexed by pixel in box (of width bw).
+static void MarkWestSteps(const ChainCode* c, uint64_t* traced,
+                          const LabelBox* box, uint32 bw) {
+  int x = (int)c->u, y = (int)c->v;
+  for (uint32 i = 0; i < c->length; i++) {
+    int d = ChainStep(c, i);
+    if (d == CHAIN_W) {
+      size_t k = (size_t)(y - (int)box->vmin) * bw + (size_t)(x - 1 - (int)box->umin);
+      traced[k / 64] |= 1ull << (k % 64);
+    }
+    x += chain_dx[d];
+    y += chain_dy[d];
+  }
+}
+
+/// Trace the contours of the region of seed pixel (u, v).
+RegionContours* ImageRegionContours(const Image img, int u, int v,
+                                    int with_holes) {
+  assert(img != NULL);
+  assert(ImageIsValidPixel(img, u, v));
+  uint16 label = img->image[v][u];
+  // (Direct reads, so debug builds count the same pixel accesses.)
+  assert(v == 0 || img->image[v - 1][u] != label);
+  assert(u == 0 || img->image[v][u - 1] != label);
+
+  RegionContours* rc = malloc(sizeof(*rc));
+  check(rc != NULL, "Alloc failed ->contours");
+  rc->label = label;
+  rc->num_holes = 0;
+  rc->holes = NULL;
+
+  // Outer contour, from the top edge of the seed
+  LabelBox box = {(uint32)u, (uint32)v, (uint32)u, (uint32)v};
+  TraceContour(img, label, u, v, CHAIN_E, &rc->outer, &box);
+  if (!with_holes) return rc;
+
+  // Pixel box (corners umax and vmax are past the last pixels)
+  box.umax--;
+  box.vmax--;
+  uint32 bw = box.umax - box.umin + 1;
+  size_t nbits = (size_t)bw * (box.vmax - box.vmin + 2);  // and row vmax+1
+  uint64_t* traced = calloc((nbits + 63) / 64, sizeof(uint64_t));
+  check(traced != NULL, "Alloc failed ->traced edges");
+  MarkWestSteps(&rc->outer, traced, &box, bw);
+
+  // A hole contour has a top edge (region above, other pixels below)
+  // not traced yet. Stretches of such edges belong to a single contour,
+  // so only the first pixel of each stretch is checked.
+  uint32 capacity = 0;
+  for (uint32 y = box.vmin + 1; y <= box.vmax; y++) {
+    const uint16* above = img->image[y - 1];
+    const uint16* row = img->image[y];
+    uint32 x = RowFind(above, box.umin, box.umax + 1, label);
+    while (x <= box.umax) {
+      uint32 end = RowRunEnd(above, x, box.umax + 1, label);
+      PIXMEM += end - x;
+      // Stretches of other pixels below the run [x, end)
+      for (uint32 i = RowRunEnd(row, x, end, label); i < end;
+           i = RowRunEnd(row, i, end, label)) {
+        size_t k = (size_t)(y - box.vmin) * bw + (i - box.umin);
+        if (!(traced[k / 64] >> (k % 64) & 1)) {
+          if (rc->num_holes == capacity) {
+            capacity = capacity == 0 ? 4 : 2 * capacity;
+            ChainCode* holes = realloc(rc->holes, capacity * sizeof(ChainCode));
+            check(holes != NULL, "Alloc failed ->holes");
+            rc->holes = holes;
+          }
+          ChainCode* hole = &rc->holes[rc->num_holes++];
+          TraceContour(img, label, (int)i + 1, (int)y, CHAIN_W, hole, NULL);
+          MarkWestSteps(hole, traced, &box, bw);
+        }
+        uint32 next = RowFind(row, i, end, label);
+        PIXMEM += next - i;
+        i = next;
+      }
+      x = RowFind(above, end, box.umax + 1, label);
+    }
+  }
+
+  free(traced);
+  return rc;
+}
+
+/// Destroy the contours pointed to by (*rcp).
+void RegionContoursDestroy(RegionContours** rcp) {
+  assert(rcp != NULL);
+  RegionContours* rc = *rcp;
+  if (rc == NULL) return;
+  free(rc->outer.codes);
+  for (uint32 i = 0; i < rc->num_holes; i++) free(rc->holes[i].codes);
+  free(rc->holes);
+  free(rc);
+  *rcp = NULL;
+}
+
+/// Morphology
+
+// The BLACK pixels are packed into a bit mask, 64 pixels per word (bit
+// x % 64 of word x / 64 of a row holds pixel x), and processed a word at a
+// time. A square structuring element is separable: dilating by radius r is
+// dilating each row by r, then each column by r. Each is done in O(log r)
+// steps: a step by t ORs the mask with its copies shifted by t and -t,
+// growing the covered span from s to s + t, with t <= s + 1.
+// Erosion is the complement of the dilation of the complement (pixels
+// outside the image count as BLACK, so the borders do not erode).
+// All passes are split into bands of rows run in parallel.
+
+// Minimum band size (in pixels) for parallel morphology
+#define MORPHOLOGY_MIN_BAND (1 << 16)
+
+struct morphology {
+  Image img;
+  size_t words;       // words per row
+  uint64_t* mask;     // h rows of words
+  uint64_t* tmp;      // scratch mask, same size
+  uint64_t padding;   // valid bits of the last word of a row
+  uint32 radius;      // radius, for row dilation
+  uint32 step;        // shift, for a column step
+  int op;             // MORPH_* operation of the pass
+  int ntasks;
+};
+
+#define MORPH_PACK 0
+#define MORPH_UNPACK 1
+#define MORPH_COMPLEMENT 2
+#define MORPH_DILATE_ROWS 3
+#define MORPH_DILATE_COLS 4
+
+// dst = src shifted by t bits toward higher (left > 0) or lower pixels.
+static void ShiftRow(const uint64_t* src, uint64_t* dst, size_t n, uint32 t,
+                     int left) {
+  size_t q = t / 64;
+  uint32 b = t % 64;
+  for (size_t k = 0; k < n; k++) {
+    uint64_t word = 0;
+    if (left) {
+      if (k >= q) word = src[k - q] << b;
+      if (b != 0 && k >= q + 1) word |= src[k - q - 1] >> (64 - b);
+    } else {
+      if (k + q < n) word = src[k + q] >> b;
+      if (b != 0 && k + q + 1 < n) word |= src[k + q + 1] << (64 - b);
+    }
+    dst[k] = word;
+  }
+}
+
+static void MorphologyTask(void* arg, int task) {
+  struct morphology* m = arg;
+  Image img = m->img;
+  uint32 w = img->width;
+  uint32 h = img->height;
+  uint32 v0 = BandStart(h, m->ntasks, task);
+  uint32 v1 = BandStart(h, m->ntasks, task + 1);
+  size_t n = m->words;
+
+  switch (m->op) {
+    case MORPH_PACK:
+      for (uint32 y = v0; y < v1; y++) {
+        Kernels->pack(img->image[y], w, BLACK, m->mask + y * n);
+      }
+      break;
+
+    case MORPH_UNPACK:
+      for (uint32 y = v0; y < v1; y++) {
+        Kernels->unpack(img->image[y], w, m->mask + y * n, BLACK, WHITE);
+      }
+      break;
+
+    case MORPH_COMPLEMENT:
+      for (uint32 y = v0; y < v1; y++) {
+        uint64_t* bits = m->mask + y * n;
+        for (size_t k = 0; k < n; k++) bits[k] = ~bits[k];
+        bits[n - 1] &= m->padding;
+      }
+      break;
+
+    case MORPH_DILATE_ROWS: {
+      uint64_t* left = malloc(2 * n * sizeof(uint64_t));
+      check(left != NULL, "Alloc failed ->row scratch");
+      uint64_t* right = left + n;
+      for (uint32 y = v0; y < v1; y++) {
+        uint64_t* bits = m->mask + y * n;
+        for (uint32 span = 0; span < m->radius;) {
+          uint32 t = span + 1 < m->radius - span ? span + 1 : m->radius - span;
+          ShiftRow(bits, left, n, t, 1);
+          ShiftRow(bits, right, n, t, 0);
+          for (size_t k = 0; k < n; k++) bits[k] |= left[k] | right[k];
+          span += t;
+        }
+        bits[n - 1] &= m->padding;
+      }
+      free(left);
+      break;
+    }
+
+    case MORPH_DILATE_COLS: {
+      uint32 t = m->step;
+      for (uint32 y = v0; y < v1; y++) {
+        const uint64_t* src = m->mask + y * n;
+        const uint64_t* up = y >= t ? m->mask + (y - t) * n : NULL;
+        const uint64_t* down = y + t < h ? m->mask + (y + t) * n : NULL;
+        uint64_t* dst = m->tmp + y * n;
+        for (size_t k = 0; k < n; k++) {
+          dst[k] = src[k] | (up != NULL ? up[k] : 0) |
+                   (down != NULL ? down[k] : 0);
+        }
+      }
+      break;
+    }
+  }
+}
+
+static void MorphologyPass(struct morphology* m, int op) {
+  m->op = op;
+  ParallelRun(m->ntasks, MorphologyTask, m);
+}
+
+// Dilate the mask of m by radius.
+static void MorphologyDilate(struct morphology* m, uint32 radius) {
+  m->radius = radius;
+  MorphologyPass(m, MORPH_DILATE_ROWS);
+  for (uint32 span = 0; span < radius;) {
+    m->step = span + 1 < radius - span ? span + 1 : radius - span;
+    MorphologyPass(m, MORPH_DILATE_COLS);
+    uint64_t* t = m->mask;
+    m->mask = m->tmp;
+    m->tmp = t;
+    span += m->step;
+  }
+}
+
+static void MorphologyErode(struct morphology* m, uint32 radius) {
+  MorphologyPass(m, MORPH_COMPLEMENT);
+  MorphologyDilate(m, radius);
+  MorphologyPass(m, MORPH_COMPLEMENT);
+}
+
+// Apply ops (a string of 'd' (dilate) and 'e' (erode)) by radius to the
+// BLACK pixels of img.
+static void ImageMorphology(Image img, uint32 radius, const char* ops) {
+  assert(img != NULL);
+  if (img->width == 0 || img->height == 0 || radius == 0) return;
+
+  struct morphology m;
+  m.img = img;
+  m.words = (img->width + 63) / 64;
+  size_t total = m.words * img->height;
+  m.mask = malloc(total * sizeof(uint64_t));
+  m.tmp = malloc(total * sizeof(uint64_t));
+  check(m.mask != NULL && m.tmp != NULL, "Alloc failed ->bit mask");
+  uint32 tail = img->width % 64;
+  m.padding = tail == 0 ? ~0ull : (1ull << tail) - 1;
+  m.ntasks = NumBands((uint64_t)img->width * img->height, MORPHOLOGY_MIN_BAND);
+  if ((uint32)m.ntasks > img->height) m.ntasks = (int)img->height;
+
+  MorphologyPass(&m, MORPH_PACK);
+  for (const char* op = ops; *op != '\0'; op++) {
+    if (*op == 'd') MorphologyDilate(&m, radius);
+    if (*op == 'e') MorphologyErode(&m, radius);
+  }
+  MorphologyPass(&m, MORPH_UNPACK);
+  PIXMEM += 2 * (uint64_t)img->width * img->height;
+
+  free(m.mask);
+  free(m.tmp);
+}
+
+/// Dilate the BLACK pixels of img by a square of radius radius.
+void ImageDilate(Image img, uint32 radius) { ImageMorphology(img, radius, "d"); }
+
+/// Erode the BLACK pixels of img by a square of radius radius.
+void ImageErode(Image img, uint32 radius) { ImageMorphology(img, radius, "e"); }
+
+/// Open (erode, then dilate) the BLACK pixels of img.
+void ImageOpen(Image img, uint32 radius) { ImageMorphology(img, radius, "ed"); }
+
+/// Close (dilate, then erode) the BLACK pixels of img.
+void ImageClose(Image img, uint32 radius) { ImageMorphology(img, radius, "de"); }
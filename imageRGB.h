@@ -15,6 +15,8 @@
 
 #include <inttypes.h>
 
+#include "PixelCoords.h"
+
 // Types for non-negative integer values
 typedef uint8_t uint8;
 typedef uint16_t uint16;
@@ -33,9 +35,29 @@ typedef struct image* Image;
 #define BLACK 1  // Black pixel label
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Set names of counters, select the row kernels for this CPU and start
+/// the thread pool of the parallel operations.
+/// (Instrumentation is calibrated lazily, see InstrGetCTU.)
 void ImageInit(void);
 
+/// Stop the thread pool started by ImageInit.
+/// Parallel operations run serially afterwards, until ImageInit.
+/// Must not be called while operations are running.
+void ImageShutdown(void);
+
+/// Set the number of threads used by the parallel operations.
+/// n == 0 (the default) uses one thread per online CPU.
+/// The thread pool is restarted with n - 1 workers (the calling thread
+/// is the other one), so this must not be called while operations are
+/// running.
+///
+/// Operations on different images may be called concurrently from
+/// several client threads; their parallel work shares the pool.
+void ImageSetThreads(int n);
+
+/// Get the number of threads used by the parallel operations.
+int ImageThreads(void);
+
 /// Image management functions
 
 /// Create a new RGB image. All pixels with the background WHITE color.
@@ -120,6 +142,36 @@ uint32 ImageHeight(const Image img);
 /// Get number of image colors
 uint16 ImageColors(const Image img);
 
+/// LUT maintenance
+
+/// Compact the LUT of img.
+/// Drops LUT entries not used by any pixel, merges entries with the same
+/// RGB color, and remaps the pixel labels accordingly (in a single pass).
+/// The WHITE and BLACK labels are always kept.
+/// The surviving labels keep their relative order.
+/// Ensures: the image colors are not modified.
+///
+/// Returns the new number of colors.
+uint16 ImageCompactLUT(Image img);
+
+/// Label statistics
+
+/// Bounding box of the pixels with some label.
+/// The box of an unused label is empty (umin > umax).
+typedef struct {
+  uint32 umin, vmin;  // top-left corner (column, row)
+  uint32 umax, vmax;  // bottom-right corner, inclusive (column, row)
+} LabelBox;
+
+/// Count the pixels of each label of img, in a single pass.
+/// The image is split into bands of rows that are counted in parallel.
+///   counts: array with ImageColors(img) elements, to receive the number
+///           of pixels of each label.
+///   boxes: NULL, or array with ImageColors(img) elements, to receive
+///          the bounding box of each label.
+/// Labels without a LUT entry are not reported.
+void ImageLabelHistogram(const Image img, uint32 counts[], LabelBox boxes[]);
+
 /// Image comparison
 
 /// These functions do not modify the images and never fail.
@@ -131,6 +183,32 @@ int ImageIsEqual(const Image img1, const Image img2);
 
 int ImageIsDifferent(const Image img1, const Image img2);
 
+/// Check if img1 and img2 have the same regions, up to relabeling: i.e.,
+/// if there is a one-to-one map of labels that turns img1 into img2.
+/// Useful to compare segmentations that number the regions differently.
+int ImageIsSamePartition(const Image img1, const Image img2);
+
+/// Orientations of the dihedral group D4 (rotations and reflections).
+/// Each code names the transform T such that img2 == T(img1).
+#define D4_NONE -1           // No orientation matches
+#define D4_IDENTITY 0        // new(r, c) = old(r, c)
+#define D4_ROT90CW 1         // new(r, c) = old(H-1-c, r)
+#define D4_ROT180 2          // new(r, c) = old(H-1-r, W-1-c)
+#define D4_ROT270CW 3        // new(r, c) = old(c, W-1-r)
+#define D4_FLIP_H 4          // new(r, c) = old(r, W-1-c)   (mirror left-right)
+#define D4_FLIP_V 5          // new(r, c) = old(H-1-r, c)   (mirror top-bottom)
+#define D4_TRANSPOSE 6       // new(r, c) = old(c, r)
+#define D4_ANTITRANSPOSE 7   // new(r, c) = old(H-1-c, W-1-r)
+
+/// Check if img2 is a rotated and/or flipped copy of img1.
+/// All eight orientations are checked by reading img1 in the transformed
+/// order, so no intermediate image is created.
+/// Colors are compared through the LUTs, as in ImageIsEqual.
+///
+/// Returns the first matching D4_* code (in the order above),
+/// or D4_NONE if img2 is not an orientation of img1.
+int ImageIsEqualUpToD4(const Image img1, const Image img2);
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -161,9 +239,32 @@ Image ImageRotate180CW(const Image img);
 ///   v : row index
 int ImageIsValidPixel(const Image img, int u, int v);
 
+/// Morphology
+
+/// These functions change the BLACK (contour) pixels of img in place, with
+/// a square structuring element of (2*radius+1) x (2*radius+1) pixels.
+/// Pixels that become BLACK lose their label; BLACK pixels that are
+/// removed become WHITE. Pixels outside the image do not make pixels
+/// BLACK, and do not erode them (i.e., the borders do not erode).
+/// The BLACK pixels are processed bit-packed, 64 per word, with separable
+/// row and column passes split among the threads (see ImageSetThreads).
+
+/// Dilate: make BLACK every pixel within radius of a BLACK pixel.
+void ImageDilate(Image img, uint32 radius);
+
+/// Erode: keep BLACK only the pixels whose whole neighborhood is BLACK.
+void ImageErode(Image img, uint32 radius);
+
+/// Open (erode, then dilate): remove BLACK specks and thin spurs.
+void ImageOpen(Image img, uint32 radius);
+
+/// Close (dilate, then erode): fill gaps of up to 2*radius pixels in the
+/// contours, e.g. before a segmentation.
+void ImageClose(Image img, uint32 radius);
+
 /// Region Growing
 
-/// The following three *RegionFilling* functions perform region growing
+/// The following *RegionFilling* functions perform region growing
 /// using some variation of the 4-neighbors flood-filling algorithm:
 ///   Given the coordinates (u, v) of a seed pixel,
 ///   fill all similarly-colored adjacent pixels with a new color label.
@@ -178,8 +279,18 @@ int ImageIsValidPixel(const Image img, int u, int v);
 /// Each function carries out a different version of the algorithm.
 
 /// Region growing using the recursive flood-filling algorithm.
+/// The recursion depth is limited (see ImageSetFillRecursionLimit):
+/// pixels reached past the limit are kept in an explicit STACK and their
+/// regions are continued later from there, so large regions never
+/// overflow the call stack. Small regions are filled in the same order
+/// as by plain recursion.
 int ImageRegionFillingRecursive(Image img, int u, int v, uint16 label);
 
+/// Set the maximum recursion depth of ImageRegionFillingRecursive.
+/// The default (10000) keeps the call stack under about 1 MB.
+/// Requires: depth > 0.
+void ImageSetFillRecursionLimit(uint32 depth);
+
 /// Region growing using a STACK of pixel coordinates to
 /// implement the flood-filling algorithm.
 int ImageRegionFillingWithSTACK(Image img, int u, int v, uint16 label);
@@ -188,19 +299,313 @@ int ImageRegionFillingWithSTACK(Image img, int u, int v, uint16 label);
 /// implement the flood-filling algorithm.
 int ImageRegionFillingWithQUEUE(Image img, int u, int v, uint16 label);
 
+/// Region growing using the scanline (span-based) flood-filling algorithm.
+/// Whole horizontal runs of pixels are filled at once, and only one seed
+/// pixel is kept (in a STACK) for each adjacent run to be filled.
+int ImageRegionFillingScanline(Image img, int u, int v, uint16 label);
+
+/// Region growing using a parallel, level-synchronous BFS.
+/// The frontier is expanded one level at a time. Large levels are split
+/// among the threads (see ImageSetThreads), which claim pixels with atomic
+/// compare-and-swap operations on their labels; small levels are expanded
+/// serially. The labeled pixels are the same as with the serial fills.
+/// Meant for huge regions; it can also be passed to ImageSegmentation.
+int ImageRegionFillingParallel(Image img, int u, int v, uint16 label);
+
 /// Type: Pointer to a region filling function:
 typedef int (*FillingFunction)(Image img, int u, int v, uint16 label);
 
+/// Region growing with a choice of neighborhood and color matching.
+/// Same arguments as the functions above, plus:
+///   connectivity: 4 (edge neighbors) or 8 (edge and corner neighbors).
+///   tolerance: 0 fills the pixels with the same label as the seed, as the
+///     functions above do. Otherwise, fills the pixels whose RGB color is
+///     within Euclidean distance tolerance of the seed's color (e.g. for
+///     scanned images with slightly varying colors).
+/// Pixels already labeled label are never part of the region.
+/// Each combination runs a specialized kernel: the 4-neighbors exact fill
+/// is the same code as ImageRegionFillingWithSTACK.
+/// Requires: connectivity == 4 or connectivity == 8.
+int ImageRegionFillingEx(Image img, int u, int v, uint16 label,
+                         int connectivity, uint32 tolerance);
+
+/// Region growing from several seeds in a single traversal.
+/// Fills each seed's region (as found in the image before the call) with
+/// its label, like one fill per seed, but with a single setup: the
+/// frontier buffer and the visited pixels are shared by all the seeds.
+///   seeds: the coordinates of the n seed pixels.
+///   labels: the n new color labels, labels[i] for seeds[i].
+///   n: the number of seeds.
+///   counts: array of n elements, to receive the number of pixels labeled
+///           from each seed.
+/// Conflicts are resolved by seed order: the first seed in a region claims
+/// all of it, and a later seed in the same region labels no pixels.
+/// A seed that already has its label labels no pixels either.
+///
+/// Returns the total number of labeled pixels.
+int ImageRegionFillingBatch(Image img, const PixelCoords seeds[],
+                            const uint16 labels[], int n, int counts[]);
+
+/// Flood-fill workspace
+
+/// Type FillContext is a pointer to a reusable flood-fill workspace.
+/// It owns the containers of pending pixels used by the fills, which grow
+/// with the actual demand and are kept from one fill to the next.
+/// Reusing one workspace across many fills (as ImageSegmentation does)
+/// avoids allocating a new container for each region.
+typedef struct fillContext* FillContext;
+
+/// Create a flood-fill workspace.
+/// (The caller is responsible for destroying the returned workspace!)
+FillContext FillContextCreate(void);
+
+/// Destroy the workspace pointed to by (*ctxp).
+/// If (*ctxp)==NULL, no operation is performed.
+///
+/// Ensures: (*ctxp)==NULL.
+void FillContextDestroy(FillContext* ctxp);
+
+/// Peak number of blocks (of QUEUE_BLOCK_SIZE pixels) used by the QUEUE
+/// fills run with ctx, for sizing purposes.
+uint32 FillContextQueuePeakBlocks(const FillContext ctx);
+
+/// Variants of the region filling functions that use the workspace ctx.
+/// Same arguments (after ctx) and result as the functions above.
+int ImageRegionFillingRecursiveCtx(FillContext ctx, Image img, int u, int v,
+                                   uint16 label);
+int ImageRegionFillingWithSTACKCtx(FillContext ctx, Image img, int u, int v,
+                                   uint16 label);
+int ImageRegionFillingWithQUEUECtx(FillContext ctx, Image img, int u, int v,
+                                   uint16 label);
+int ImageRegionFillingScanlineCtx(FillContext ctx, Image img, int u, int v,
+                                  uint16 label);
+int ImageRegionFillingExCtx(FillContext ctx, Image img, int u, int v,
+                            uint16 label, int connectivity, uint32 tolerance);
+
+/// Type: Pointer to a region filling function that uses a workspace:
+typedef int (*FillingFunctionCtx)(FillContext ctx, Image img, int u, int v,
+                                  uint16 label);
+
 /// Image Segmentation
 
 /// Label each WHITE region with a different color.
 /// - WHITE (the background color) has label (LUT index) 0.
 /// - Use GenerateNextColor to create the RGB color for each new region.
+/// - Each region gets a new LUT entry, in the order its first pixel is
+///   found in a raster scan. When the LUT is full, the remaining regions
+///   are left WHITE.
 ///
 /// One of the region filling functions above is passed as the
 /// last argument, using a function pointer.
+/// If it has a workspace variant, a single workspace is used for all the
+/// regions.
 ///
 /// Returns the number of image regions found.
 int ImageSegmentation(Image img, FillingFunction fillFunct);
 
+/// Label each WHITE region with a different color, using two-pass
+/// connected-component labeling instead of one flood fill per region.
+/// The first raster pass gives each WHITE pixel a provisional label and
+/// records which labels belong to the same region (in a union-find);
+/// the second pass replaces them by the final labels.
+/// Only two rows of provisional labels are kept, and there is no
+/// per-region allocation.
+/// Large images are split into bands of rows that are labeled in parallel
+/// (see ImageSetThreads); the labels are then merged across the band
+/// borders, so the result does not depend on the number of threads.
+///
+/// Gives the same result as ImageSegmentation: same labels, colors and
+/// LUT, and same number of regions (the return value).
+int ImageSegmentationUnionFind(Image img);
+
+/// Label each WHITE region with a different color, using run-length
+/// connected-component labeling.
+/// The WHITE pixels of each row are first grouped into runs (found several
+/// pixels at a time); the runs, not the pixels, are then labeled and
+/// connected to the overlapping runs of the row above, and finally filled
+/// with their region's label. Fastest on images with long runs, such as
+/// contour maps.
+///
+/// Gives the same result as ImageSegmentation.
+int ImageSegmentationRuns(Image img);
+
+/// Descriptor of a labeled region.
+typedef struct {
+  uint16 label;          // the region's label (LUT index)
+  uint32 area;           // number of pixels
+  uint32 seed_u, seed_v; // first pixel of the region, in raster order
+  LabelBox box;          // bounding box
+  double cu, cv;         // centroid (mean column, mean row)
+} RegionInfo;
+
+/// Label each WHITE region with a different color, as
+/// ImageSegmentationRuns does, and describe the regions.
+/// The descriptors are computed from the runs while they are labeled,
+/// with no additional pass over the image.
+///   regions: address of a RegionInfo pointer, to receive an array with
+///            one descriptor per labeled region, in label order (NULL if
+///            there are no regions).
+///            (The caller is responsible for freeing the array!)
+///
+/// Returns the number of regions found (the size of the array).
+int ImageSegmentationWithStats(Image img, RegionInfo** regions);
+
+/// Region adjacency
+
+/// Region adjacency graph, in compressed sparse row (CSR) form.
+/// Nodes are labels: the neighbors of label l are
+///   neighbors[offsets[l]], ..., neighbors[offsets[l+1] - 1]
+/// in increasing order. Each adjacency is listed for both labels.
+typedef struct {
+  uint32 num_labels;   // number of nodes (the image colors)
+  uint32* offsets;     // num_labels + 1 elements
+  uint16* neighbors;   // offsets[num_labels] elements
+} RegionAdjacency;
+
+/// Build the adjacency graph of the regions of img (usually segmented).
+/// Every label but BLACK is a region. Two regions are adjacent if, along
+/// some row or column, a pixel of one is followed by a pixel of the other
+/// with at most thickness BLACK (contour) pixels between them.
+/// (thickness 1 joins the regions on both sides of a one-pixel contour.)
+/// Labels without a LUT entry are not reported.
+/// Each row is scanned once; bands of rows are scanned in parallel.
+///
+/// On success, a new graph is returned.
+/// (The caller is responsible for destroying the returned graph!)
+RegionAdjacency* ImageRegionAdjacency(const Image img, uint32 thickness);
+
+/// Destroy the graph pointed to by (*graphp).
+/// If (*graphp)==NULL, no operation is performed.
+///
+/// Ensures: (*graphp)==NULL.
+void RegionAdjacencyDestroy(RegionAdjacency** graphp);
+
+/// Region contours
+
+/// Steps of a chain code: moves from a pixel corner to the next one.
+#define CHAIN_E 0  // u + 1
+#define CHAIN_S 1  // v + 1
+#define CHAIN_W 2  // u - 1
+#define CHAIN_N 3  // v - 1
+
+/// A closed contour, as a chain code packed 2 bits per step.
+/// Contours follow the edges between pixels: corner (u, v) is the top-left
+/// corner of pixel (u, v).
+typedef struct {
+  uint32 u, v;    // start corner
+  uint32 length;  // number of steps
+  uint8* codes;   // step i is (codes[i / 4] >> (2 * (i % 4))) & 3
+} ChainCode;
+
+/// The contours of a region.
+/// The outer contour goes clockwise around the region, and the hole
+/// contours go counterclockwise around its holes (the region is always
+/// on the right-hand side).
+typedef struct {
+  uint16 label;        // the region's label
+  ChainCode outer;     // outer contour
+  uint32 num_holes;    // number of hole contours
+  ChainCode* holes;    // hole contours
+} RegionContours;
+
+/// Trace the contours of the region of seed pixel (u, v), with regions
+/// made of 4-connected pixels of the same label.
+///   u, v: the region's first pixel in raster order (e.g. the seed of its
+///         RegionInfo), whose top edge is on the outer contour.
+///   with_holes: nonzero to also trace the hole contours.
+/// The outer contour is traced from the seed, visiting only pixels next to
+/// the contour: its cost is proportional to the perimeter.
+/// Finding the holes needs a scan of the region's bounding box, done a run
+/// at a time (several pixels per step).
+///
+/// On success, new contours are returned.
+/// (The caller is responsible for destroying the returned contours!)
+RegionContours* ImageRegionContours(const Image img, int u, int v,
+                                    int with_holes);
+
+/// Destroy the contours pointed to by (*rcp).
+/// If (*rcp)==NULL, no operation is performed.
+///
+/// Ensures: (*rcp)==NULL.
+void RegionContoursDestroy(RegionContours** rcp);
+
+/// Streaming segmentation
+
+/// Segment the BW image in the PBM file infile, as ImageSegmentation does,
+/// and save the result to the PPM file outfile, without loading the image.
+/// The input is read band_rows rows at a time, twice: the first pass gives
+/// provisional labels to the WHITE pixels, keeping only the sets of labels
+/// still open in the previous row, and writes to a temporary relabel file
+/// the set of each label as it merges or closes. The labels are resolved
+/// in that file, and the second pass replays them and writes each row with
+/// the final region colors.
+/// Memory use is O(width x band_rows): at most width + 1 sets are kept,
+/// whatever the height or the number of regions.
+/// Requires: band_rows > 0.
+///
+/// The output equals ImageSavePPM of the segmented image.
+/// Returns the number of regions found.
+int ImageSegmentationStreamPBM(const char* infile, const char* outfile,
+                               uint32 band_rows);
+
+/// Largest number of label sets kept at once by the last call to
+/// ImageSegmentationStreamPBM (at most its width + 1).
+uint32 ImageSegmentationStreamPeakSets(void);
+
+/// Incremental segmentation
+
+/// Type Segmentation is a pointer to the state of an incremental
+/// segmentation of an image: the image labels themselves, plus the area of
+/// each region. After a few pixels are drawn or erased, it updates only the
+/// regions they touch, instead of segmenting the whole image again.
+typedef struct segmentationState* Segmentation;
+
+/// Returned by SegmentationUpdate when the LUT has no label left for a
+/// new region.
+#define SEGMENTATION_LUT_FULL UINT32_MAX
+
+/// Segment the BW image img (WHITE background, BLACK contours) in place,
+/// as ImageSegmentationRuns does, and keep the state for later updates.
+/// The image must stay alive, and be modified only through
+/// SegmentationUpdate, while the segmentation exists.
+/// Requires: img has only WHITE and BLACK pixels.
+///
+/// Returns NULL if img has more regions than the LUT can label (img is
+/// then left as ImageSegmentationRuns leaves it).
+///
+/// (The caller is responsible for destroying the returned segmentation!)
+Segmentation SegmentationCreate(Image img);
+
+/// Destroy the segmentation pointed to by (*segp). The image is kept.
+/// If (*segp)==NULL, no operation is performed.
+///
+/// Ensures: (*segp)==NULL.
+void SegmentationDestroy(Segmentation* segp);
+
+/// Get the number of regions.
+int SegmentationRegions(const Segmentation seg);
+
+/// Get the number of pixels of the region with the given label
+/// (0 if there is no such region).
+uint32 SegmentationArea(const Segmentation seg, uint16 label);
+
+/// Draw (value == BLACK) or erase (value == WHITE) the n given pixels.
+/// A contour drawn across a region splits it: the pieces are explored
+/// together, and each piece that is fully explored while others remain
+/// gets a new label; the last piece keeps the old one. Erasing a contour
+/// pixel merges the regions around it into the largest one.
+/// Labels of regions that vanish are reused for new regions.
+/// The cost is proportional to the pixels that change label (times the
+/// number of edited pixels next to a region), not to the image size.
+///
+/// Ensures: the image has the same regions as a full segmentation of the
+/// edited BW image (ImageIsSamePartition), with unaffected regions keeping
+/// their labels.
+///
+/// Returns the number of pixels whose label changed, or
+/// SEGMENTATION_LUT_FULL if a new region would need a label and the LUT
+/// has none left; the image and the segmentation are then unchanged.
+uint32 SegmentationUpdate(Segmentation seg, const PixelCoords pixels[], int n,
+                          uint16 value);
+
 #endif
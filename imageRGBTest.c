@@ -11,13 +11,18 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "error.h"
+#include "imageKernels.h"
 #include "imageRGB.h"
 #include "instrumentation.h"
+#include "threadPool.h"
 
 
 // ======================= TESTES FEITOS POR BERNARDO REIS E FERNANDO =======================
@@ -40,6 +45,65 @@ static int tests_failed = 0;
   } while(0)
 #define TEST_END() printf("---\n")
 
+// Create a BW image from a mask (nonzero = BLACK), by saving it to a PBM
+// file and loading it back.
+static Image CreateBW(const unsigned char* black, uint32 width, uint32 height,
+                      const char* filename) {
+  FILE* f = fopen(filename, "wb");
+  if (f == NULL) return NULL;
+  fprintf(f, "P4\n%u %u\n", width, height);
+  for (uint32 y = 0; y < height; y++) {
+    unsigned char byte = 0;
+    for (uint32 x = 0; x < width; x++) {
+      if (black[y * width + x]) byte |= 0x80 >> (x % 8);
+      if (x % 8 == 7 || x + 1 == width) {
+        fputc(byte, f);
+        byte = 0;
+      }
+    }
+  }
+  fclose(f);
+  return ImageLoadPBM(filename);
+}
+
+// Fill a mask with about percent % BLACK pixels.
+// The same seed gives the same mask.
+static void RandomMask(unsigned char* black, uint32 n, int percent,
+                       unsigned seed) {
+  for (uint32 i = 0; i < n; i++) {
+    seed = seed * 1103515245u + 12345u;
+    black[i] = (int)((seed >> 16) % 100) < percent;
+  }
+}
+
+// Create a random BW image (about percent % BLACK pixels).
+static Image CreateRandomBW(uint32 width, uint32 height, int percent,
+                            unsigned seed, const char* filename) {
+  unsigned char* black = malloc((size_t)width * height);
+  if (black == NULL) return NULL;
+  RandomMask(black, width * height, percent, seed);
+  Image img = CreateBW(black, width, height, filename);
+  free(black);
+  return img;
+}
+
+// Apply the D4 orientation t (a D4_* code) to the w x h mask src, as
+// documented in imageRGB.h. dst gets the (*nw) x (*nh) result.
+static void D4Transform(const unsigned char* src, uint32 w, uint32 h, int t,
+                        unsigned char* dst, uint32* nw, uint32* nh) {
+  int swap = t == D4_ROT90CW || t == D4_ROT270CW || t == D4_TRANSPOSE ||
+             t == D4_ANTITRANSPOSE;
+  *nw = swap ? h : w;
+  *nh = swap ? w : h;
+  for (uint32 r = 0; r < *nh; r++) {
+    for (uint32 c = 0; c < *nw; c++) {
+      uint32 sr[8] = {r, h - 1 - c, h - 1 - r, c, r, h - 1 - r, c, h - 1 - c};
+      uint32 sc[8] = {c, r, w - 1 - c, w - 1 - r, w - 1 - c, c, r, w - 1 - r};
+      dst[r * *nw + c] = src[sr[t] * w + sc[t]];
+    }
+  }
+}
+
 // Test functions
 void test_image_creation() {
   TEST_START("Image Creation");
@@ -188,6 +252,81 @@ void test_rotation_180() {
   TEST_END();
 }
 
+void test_rotation_d4() {
+  TEST_START("Orientation Matching (D4)");
+
+  // Every pixel of this palete gets its own label (no symmetries)
+  Image original = ImageCreatePalete(6, 4, 1);
+  Image rot90 = ImageRotate90CW(original);
+  Image rot180 = ImageRotate180CW(original);
+  Image rot270 = ImageRotate90CW(rot180);
+  Image other = ImageCreatePalete(6, 4, 2);
+
+  TEST_ASSERT(ImageIsEqualUpToD4(original, original) == D4_IDENTITY,
+              "Image matches itself with identity");
+  TEST_ASSERT(ImageIsEqualUpToD4(original, rot90) == D4_ROT90CW,
+              "Rotated 90° copy is detected");
+  TEST_ASSERT(ImageIsEqualUpToD4(original, rot180) == D4_ROT180,
+              "Rotated 180° copy is detected");
+  TEST_ASSERT(ImageIsEqualUpToD4(original, rot270) == D4_ROT270CW,
+              "Rotated 270° copy is detected");
+  TEST_ASSERT(ImageIsEqualUpToD4(rot90, original) == D4_ROT270CW,
+              "Inverse rotation is detected");
+  TEST_ASSERT(ImageIsEqualUpToD4(original, other) == D4_NONE,
+              "Different image matches no orientation");
+
+  // Each of the 8 orientations of asymmetric BW shapes is found
+  const unsigned char wide[5 * 3] = {1, 1, 1, 0, 0,
+                                     1, 0, 0, 0, 0,
+                                     1, 1, 0, 0, 1};
+  const unsigned char square[4 * 4] = {1, 1, 1, 0,
+                                       1, 0, 0, 0,
+                                       1, 1, 0, 0,
+                                       0, 0, 0, 1};
+  const unsigned char* shapes[2] = {wide, square};
+  uint32 shape_w[2] = {5, 4};
+  uint32 shape_h[2] = {3, 4};
+  int all_found = 1;
+  for (int i = 0; i < 2; i++) {
+    Image base = CreateBW(shapes[i], shape_w[i], shape_h[i], "img/d4.pbm");
+    if (base == NULL) {
+      all_found = 0;
+      continue;
+    }
+    for (int t = D4_IDENTITY; t <= D4_ANTITRANSPOSE; t++) {
+      unsigned char moved[4 * 4];  // room for both shapes
+      uint32 nw, nh;
+      D4Transform(shapes[i], shape_w[i], shape_h[i], t, moved, &nw, &nh);
+      Image img = CreateBW(moved, nw, nh, "img/d4.pbm");
+      int found = ImageIsEqualUpToD4(base, img);
+      if (found != t) {
+        printf("  → %ux%u: orientation %d found as %d\n", shape_w[i],
+               shape_h[i], t, found);
+        all_found = 0;
+      }
+      ImageDestroy(&img);
+    }
+    ImageDestroy(&base);
+  }
+  TEST_ASSERT(all_found, "Every orientation is detected exactly");
+
+  // A chess square pattern is symmetric: the first match is the identity
+  Image chess = ImageCreateChess(40, 40, 10, 0x000000);
+  Image chess180 = ImageRotate180CW(chess);
+  TEST_ASSERT(ImageIsEqualUpToD4(chess, chess180) == D4_IDENTITY,
+              "Symmetric chess matches with identity first");
+
+  ImageDestroy(&original);
+  ImageDestroy(&rot90);
+  ImageDestroy(&rot180);
+  ImageDestroy(&rot270);
+  ImageDestroy(&other);
+  ImageDestroy(&chess);
+  ImageDestroy(&chess180);
+
+  TEST_END();
+}
+
 void test_file_operations() {
   TEST_START("File I/O Operations");
   
@@ -232,6 +371,77 @@ void test_file_operations() {
   TEST_END();
 }
 
+void test_compact_lut() {
+  TEST_START("LUT Compaction");
+
+  // 10x10 tiles use only the first 100 of the 1000 palete colors
+  Image palete = ImageCreatePalete(40, 40, 4);
+  Image palete_copy = ImageCopy(palete);
+  uint16 n = ImageCompactLUT(palete);
+  TEST_ASSERT(n == 100, "Unused palete colors are dropped (100 left)");
+  TEST_ASSERT(ImageColors(palete) == 100, "ImageColors reports compacted LUT");
+  TEST_ASSERT(ImageIsEqual(palete, palete_copy), "Compaction keeps image colors");
+  ImageDestroy(&palete);
+  ImageDestroy(&palete_copy);
+
+  // Overwrite one segmented region: its label becomes unused
+  Image seg = ImageCreateChess(40, 40, 10, 0x000000);
+  int regions = ImageSegmentation(seg, ImageRegionFillingWithQUEUE);
+  TEST_ASSERT(ImageColors(seg) == 2 + regions, "Segmentation adds one color per region");
+  ImageRegionFillingWithQUEUE(seg, 15, 5, BLACK);
+  Image seg_copy = ImageCopy(seg);
+  n = ImageCompactLUT(seg);
+  TEST_ASSERT(n == 1 + regions, "Label of overwritten region is dropped");
+  TEST_ASSERT(ImageIsEqual(seg, seg_copy), "Compaction remaps labels correctly");
+  TEST_ASSERT(ImageCompactLUT(seg) == n, "Compaction is idempotent");
+  ImageDestroy(&seg);
+  ImageDestroy(&seg_copy);
+
+  TEST_END();
+}
+
+void test_label_histogram() {
+  TEST_START("Label Histogram");
+
+  Image chess = ImageCreateChess(40, 30, 10, 0xff0000);
+  uint32 counts[3];
+  LabelBox boxes[3];
+  ImageLabelHistogram(chess, counts, boxes);
+  TEST_ASSERT(counts[0] == 600 && counts[2] == 600, "Chess labels have 600 pixels each");
+  TEST_ASSERT(counts[BLACK] == 0, "Unused BLACK label has no pixels");
+  TEST_ASSERT(boxes[2].umin == 0 && boxes[2].vmin == 0 &&
+              boxes[2].umax == 39 && boxes[2].vmax == 29,
+              "Bounding box covers the chess squares");
+  TEST_ASSERT(boxes[BLACK].umin > boxes[BLACK].umax, "Unused label has empty box");
+  ImageDestroy(&chess);
+
+  // Parallel bands must give the same result as a single band
+  Image palete = ImageCreatePalete(512, 512, 16);
+  uint32* serial = malloc(ImageColors(palete) * sizeof(uint32));
+  uint32* parallel = malloc(ImageColors(palete) * sizeof(uint32));
+  LabelBox* serial_boxes = malloc(ImageColors(palete) * sizeof(LabelBox));
+  LabelBox* parallel_boxes = malloc(ImageColors(palete) * sizeof(LabelBox));
+  ImageSetThreads(1);
+  ImageLabelHistogram(palete, serial, serial_boxes);
+  ImageSetThreads(4);
+  ImageLabelHistogram(palete, parallel, parallel_boxes);
+  ImageSetThreads(0);
+  TEST_ASSERT(memcmp(serial, parallel, ImageColors(palete) * sizeof(uint32)) == 0,
+              "Parallel counts equal serial counts");
+  TEST_ASSERT(memcmp(serial_boxes, parallel_boxes,
+                     ImageColors(palete) * sizeof(LabelBox)) == 0,
+              "Parallel boxes equal serial boxes");
+  TEST_ASSERT(serial[50] == 256 && serial_boxes[50].umin == 288 &&
+              serial_boxes[50].vmax == 31, "Palete tile has 16x16 pixels");
+  free(serial);
+  free(parallel);
+  free(serial_boxes);
+  free(parallel_boxes);
+  ImageDestroy(&palete);
+
+  TEST_END();
+}
+
 void test_region_filling_stack() {
   TEST_START("Region Filling with STACK");
   
@@ -312,6 +522,177 @@ void test_region_filling_recursive() {
   TEST_END();
 }
 
+void test_recursive_depth_limit() {
+  TEST_START("Recursive Fill Depth Limit");
+
+  // A region far larger than the default depth limit must not overflow
+  Image big = ImageCreate(2000, 2000);
+  Image big_copy = ImageCopy(big);
+  int c1 = ImageRegionFillingRecursive(big, 1000, 1000, BLACK);
+  int c2 = ImageRegionFillingWithSTACK(big_copy, 1000, 1000, BLACK);
+  TEST_ASSERT(c1 == 4000000, "Recursive fill labels a 2000x2000 region");
+  TEST_ASSERT(c1 == c2 && ImageIsEqual(big, big_copy), "Recursive and STACK fills agree");
+  ImageDestroy(&big);
+  ImageDestroy(&big_copy);
+
+  // A tiny limit defers most pixels but gives the same result
+  ImageSetFillRecursionLimit(16);
+  Image chess = ImageCreateChess(200, 200, 50, 0x000000);
+  Image chess_copy = ImageCopy(chess);
+  int c3 = ImageRegionFillingRecursive(chess, 10, 60, 2);
+  int c4 = ImageRegionFillingWithQUEUE(chess_copy, 10, 60, 2);
+  TEST_ASSERT(c3 == 2500 && c3 == c4, "Small limit fills the whole square");
+  TEST_ASSERT(ImageIsEqual(chess, chess_copy), "Small limit gives the same image");
+  ImageSetFillRecursionLimit(10000);
+  ImageDestroy(&chess);
+  ImageDestroy(&chess_copy);
+
+  TEST_END();
+}
+
+void test_fill_connectivity_tolerance() {
+  TEST_START("Fill Connectivity and Tolerance");
+
+  // Exact 4-neighbors fill is the STACK fill
+  Image chess = ImageCreateChess(40, 40, 10, 0x000000);
+  Image chess_copy = ImageCopy(chess);
+  int c1 = ImageRegionFillingEx(chess, 5, 5, 2, 4, 0);
+  int c2 = ImageRegionFillingWithSTACK(chess_copy, 5, 5, 2);
+  TEST_ASSERT(c1 == 100 && c1 == c2, "Exact 4-connected fill fills one square");
+  TEST_ASSERT(ImageIsEqual(chess, chess_copy), "Exact 4-connected fill matches STACK");
+  ImageDestroy(&chess);
+  ImageDestroy(&chess_copy);
+
+  // Squares of the same color touch at the corners
+  chess = ImageCreateChess(40, 40, 10, 0x000000);
+  int c3 = ImageRegionFillingEx(chess, 5, 5, 2, 8, 0);
+  TEST_ASSERT(c3 == 800, "8-connected fill crosses square corners");
+  ImageDestroy(&chess);
+
+  // Slightly different grays, split by a bright pixel
+  FILE* f = fopen("img/tolerance.ppm", "w");
+  TEST_ASSERT(f != NULL, "Test PPM file created");
+  if (f != NULL) {
+    fprintf(f, "P3\n5 1\n255\n");
+    fprintf(f, "100 100 100  105 100 100  103 104 100  200 200 200  102 100 100\n");
+    fclose(f);
+
+    Image grays = ImageLoadPPM("img/tolerance.ppm");
+    Image grays_copy = ImageCopy(grays);
+    Image grays_exact = ImageCopy(grays);
+    int c4 = ImageRegionFillingEx(grays, 0, 0, BLACK, 4, 10);
+    TEST_ASSERT(c4 == 3, "Tolerant fill takes similar colors up to the bright pixel");
+    int c5 = ImageRegionFillingEx(grays_copy, 0, 0, BLACK, 4, 200);
+    TEST_ASSERT(c5 == 5, "Large tolerance takes every pixel");
+    int c6 = ImageRegionFillingEx(grays_exact, 0, 0, BLACK, 8, 0);
+    TEST_ASSERT(c6 == 1, "Zero tolerance only takes the seed label");
+    ImageDestroy(&grays);
+    ImageDestroy(&grays_copy);
+    ImageDestroy(&grays_exact);
+  }
+
+  TEST_END();
+}
+
+void test_batch_fill() {
+  TEST_START("Multi-Seed Batch Fill");
+
+  // Seeds in different regions give the same result as one fill per seed
+  Image chess = ImageCreateChess(40, 40, 10, 0x000000);
+  Image chess_copy = ImageCopy(chess);
+  PixelCoords seeds[5] = {PixelCoordsCreate(5, 5), PixelCoordsCreate(25, 5),
+                          PixelCoordsCreate(15, 15), PixelCoordsCreate(35, 35),
+                          PixelCoordsCreate(5, 5)};
+  uint16 labels[5] = {2, 3, 4, 5, 6};
+  int counts[5];
+  int total = ImageRegionFillingBatch(chess, seeds, labels, 5, counts);
+  TEST_ASSERT(total == 400, "Batch fill labels four squares");
+  TEST_ASSERT(counts[0] == 100 && counts[1] == 100 && counts[2] == 100 &&
+                  counts[3] == 100,
+              "Each seed labels its own square");
+  TEST_ASSERT(counts[4] == 0, "A seed on a claimed pixel labels nothing");
+  for (int i = 0; i < 4; i++) {
+    ImageRegionFillingWithQUEUE(chess_copy, PixelCoordsGetU(seeds[i]),
+                                PixelCoordsGetV(seeds[i]), labels[i]);
+  }
+  TEST_ASSERT(ImageIsEqual(chess, chess_copy), "Batch fill matches one fill per seed");
+  ImageDestroy(&chess);
+  ImageDestroy(&chess_copy);
+
+  // The first seed in a shared region claims all of it
+  Image line = ImageCreate(9, 1);
+  PixelCoords ends[2] = {PixelCoordsCreate(0, 0), PixelCoordsCreate(8, 0)};
+  uint16 end_labels[2] = {BLACK, 2};
+  int end_counts[2];
+  ImageRegionFillingBatch(line, ends, end_labels, 2, end_counts);
+  TEST_ASSERT(end_counts[0] == 9 && end_counts[1] == 0,
+              "Shared region goes to the first seed");
+  ImageDestroy(&line);
+
+  TEST_END();
+}
+
+void test_parallel_fill() {
+  TEST_START("Parallel Frontier Fill");
+
+  // Large region: the widest levels are expanded by several threads
+  ImageSetThreads(4);
+  Image big = ImageCreate(2000, 2000);
+  Image big_copy = ImageCopy(big);
+  int c1 = ImageRegionFillingParallel(big, 1000, 1000, BLACK);
+  int c2 = ImageRegionFillingWithSTACK(big_copy, 1000, 1000, BLACK);
+  TEST_ASSERT(c1 == 4000000 && c1 == c2, "Parallel fill counts every pixel once");
+  TEST_ASSERT(ImageIsEqual(big, big_copy), "Parallel and STACK fills agree");
+  ImageDestroy(&big);
+  ImageDestroy(&big_copy);
+
+  // Many small regions, through ImageSegmentation
+  Image chess = ImageCreateChess(300, 300, 7, 0x000000);
+  Image chess_copy = ImageCopy(chess);
+  int r1 = ImageSegmentation(chess, ImageRegionFillingParallel);
+  int r2 = ImageSegmentation(chess_copy, ImageRegionFillingWithSTACK);
+  TEST_ASSERT(r1 == r2, "Parallel segmentation finds the same regions");
+  TEST_ASSERT(ImageIsEqual(chess, chess_copy), "Parallel segmentation gives the same image");
+  ImageDestroy(&chess);
+  ImageDestroy(&chess_copy);
+  ImageSetThreads(0);
+
+  TEST_END();
+}
+
+void test_fill_context() {
+  TEST_START("Reusable Fill Context");
+
+  FillContext ctx = FillContextCreate();
+  TEST_ASSERT(ctx != NULL, "FillContextCreate returns non-NULL");
+
+  // The same workspace serves many fills with different methods
+  Image chess = ImageCreateChess(40, 40, 10, 0x000000);
+  int c1 = ImageRegionFillingWithSTACKCtx(ctx, chess, 15, 5, 2);
+  int c2 = ImageRegionFillingWithQUEUECtx(ctx, chess, 5, 15, 2);
+  int c3 = ImageRegionFillingScanlineCtx(ctx, chess, 35, 5, 2);
+  TEST_ASSERT(c1 == 100 && c2 == 100 && c3 == 100, "Each reused fill labels one square");
+  ImageDestroy(&chess);
+
+  // Large regions make the containers grow past their initial size
+  Image big = ImageCreate(300, 300);
+  Image big_copy = ImageCopy(big);
+  int c4 = ImageRegionFillingWithQUEUECtx(ctx, big, 150, 150, BLACK);
+  int c5 = ImageRegionFillingWithSTACKCtx(ctx, big_copy, 0, 0, BLACK);
+  TEST_ASSERT(c4 == 90000 && c5 == 90000, "Reused workspace grows for large regions");
+  printf("  → QUEUE peak blocks: %u\n", FillContextQueuePeakBlocks(ctx));
+  TEST_ASSERT(FillContextQueuePeakBlocks(ctx) < 10,
+              "QUEUE memory follows the frontier, not the region");
+  TEST_ASSERT(ImageIsEqual(big, big_copy), "STACK and QUEUE fills agree");
+  ImageDestroy(&big);
+  ImageDestroy(&big_copy);
+
+  FillContextDestroy(&ctx);
+  TEST_ASSERT(ctx == NULL, "FillContextDestroy sets pointer to NULL");
+
+  TEST_END();
+}
+
 void test_region_filling_consistency() {
   TEST_START("Region Filling Consistency (Stack vs Queue vs Recursive)");
   
@@ -350,22 +731,29 @@ void test_fill_methods_performance() {
   
   InstrReset();
   int c1 = ImageRegionFillingRecursive(blank1, 25, 25, 1);
-  printf("    Recursive: %d pixels, ops: %lu\n", c1, InstrCount[0]);
+  printf("    Recursive: %d pixels, ops: %lu, pushes: %lu\n", c1, InstrRead(0), InstrRead(1));
   
   InstrReset();
   int c2 = ImageRegionFillingWithSTACK(blank2, 25, 25, 1);
-  printf("    Stack:     %d pixels, ops: %lu\n", c2, InstrCount[0]);
+  printf("    Stack:     %d pixels, ops: %lu, pushes: %lu\n", c2, InstrRead(0), InstrRead(1));
   
   InstrReset();
   int c3 = ImageRegionFillingWithQUEUE(blank3, 25, 25, 1);
-  printf("    Queue:     %d pixels, ops: %lu\n", c3, InstrCount[0]);
+  printf("    Queue:     %d pixels, ops: %lu, pushes: %lu\n", c3, InstrRead(0), InstrRead(1));
+  
+  Image blank4 = ImageCreate(50, 50);
+  InstrReset();
+  int c4 = ImageRegionFillingScanline(blank4, 25, 25, 1);
+  printf("    Scanline:  %d pixels, ops: %lu, pushes: %lu\n", c4, InstrRead(0), InstrRead(1));
   
   TEST_ASSERT(c1 == c2 && c2 == c3, "All methods fill same count (blank 50x50)");
   TEST_ASSERT(c1 == 2500, "Fills entire 50x50 image (2500 pixels)");
+  TEST_ASSERT(c4 == c1 && ImageIsEqual(blank1, blank4), "Scanline fills same pixels (blank 50x50)");
   
   ImageDestroy(&blank1);
   ImageDestroy(&blank2);
   ImageDestroy(&blank3);
+  ImageDestroy(&blank4);
   
   // Chess pattern - single region
   printf("\n  → Chess 40x40 (edge=20) single region:\n");
@@ -375,24 +763,31 @@ void test_fill_methods_performance() {
   
   InstrReset();
   c1 = ImageRegionFillingRecursive(chess1, 2, 2, 5);
-  printf("    Recursive: %d pixels, ops: %lu\n", c1, InstrCount[0]);
+  printf("    Recursive: %d pixels, ops: %lu, pushes: %lu\n", c1, InstrRead(0), InstrRead(1));
   
   InstrReset();
   c2 = ImageRegionFillingWithSTACK(chess2, 2, 2, 5);
-  printf("    Stack:     %d pixels, ops: %lu\n", c2, InstrCount[0]);
+  printf("    Stack:     %d pixels, ops: %lu, pushes: %lu\n", c2, InstrRead(0), InstrRead(1));
   
   InstrReset();
   c3 = ImageRegionFillingWithQUEUE(chess3, 2, 2, 5);
-  printf("    Queue:     %d pixels, ops: %lu\n", c3, InstrCount[0]);
+  printf("    Queue:     %d pixels, ops: %lu, pushes: %lu\n", c3, InstrRead(0), InstrRead(1));
   
   TEST_ASSERT(c1 == c2 && c2 == c3, "All methods fill same count (chess region)");
   TEST_ASSERT(c1 == 400, "Fills 20x20 chess square (400 pixels)");
   TEST_ASSERT(ImageIsEqual(chess1, chess2) && ImageIsEqual(chess2, chess3), 
               "All methods produce identical images");
   
+  Image chess4 = ImageCreateChess(40, 40, 20, 0x000000);
+  InstrReset();
+  int c4b = ImageRegionFillingScanline(chess4, 2, 2, 5);
+  printf("    Scanline:  %d pixels, ops: %lu, pushes: %lu\n", c4b, InstrRead(0), InstrRead(1));
+  TEST_ASSERT(c4b == c1 && ImageIsEqual(chess1, chess4), "Scanline fills same pixels (chess region)");
+  
   ImageDestroy(&chess1);
   ImageDestroy(&chess2);
   ImageDestroy(&chess3);
+  ImageDestroy(&chess4);
   
   // Complex pattern
   printf("\n  → Chess 60x60 (edge=10) complex:\n");
@@ -402,17 +797,24 @@ void test_fill_methods_performance() {
   
   InstrReset();
   c1 = ImageRegionFillingRecursive(complex1, 5, 5, 7);
-  printf("    Recursive: %d pixels, ops: %lu\n", c1, InstrCount[0]);
+  printf("    Recursive: %d pixels, ops: %lu, pushes: %lu\n", c1, InstrRead(0), InstrRead(1));
   
   InstrReset();
   c2 = ImageRegionFillingWithSTACK(complex2, 5, 5, 7);
-  printf("    Stack:     %d pixels, ops: %lu\n", c2, InstrCount[0]);
+  printf("    Stack:     %d pixels, ops: %lu, pushes: %lu\n", c2, InstrRead(0), InstrRead(1));
   
   InstrReset();
   c3 = ImageRegionFillingWithQUEUE(complex3, 5, 5, 7);
-  printf("    Queue:     %d pixels, ops: %lu\n", c3, InstrCount[0]);
+  printf("    Queue:     %d pixels, ops: %lu, pushes: %lu\n", c3, InstrRead(0), InstrRead(1));
+  
+  Image complex4 = ImageCreateChess(60, 60, 10, 0x000000);
+  InstrReset();
+  int c4c = ImageRegionFillingScanline(complex4, 5, 5, 7);
+  printf("    Scanline:  %d pixels, ops: %lu, pushes: %lu\n", c4c, InstrRead(0), InstrRead(1));
   
   TEST_ASSERT(c1 == c2 && c2 == c3, "All methods fill same count (complex)");
+  TEST_ASSERT(c4c == c1 && ImageIsEqual(complex1, complex4), "Scanline fills same pixels (complex)");
+  ImageDestroy(&complex4);
   
   // Nota: A ordem de visita do pixel pode variar entre os métodos.
   
@@ -435,17 +837,17 @@ void test_segmentation_comparison() {
   Image seg1 = ImageCopy(base);
   InstrReset();
   int regions_rec = ImageSegmentation(seg1, ImageRegionFillingRecursive);
-  printf("    Recursive: %d regions, ops: %lu\n", regions_rec, InstrCount[0]);
+  printf("    Recursive: %d regions, ops: %lu\n", regions_rec, InstrRead(0));
   
   Image seg2 = ImageCopy(base);
   InstrReset();
   int regions_stack = ImageSegmentation(seg2, ImageRegionFillingWithSTACK);
-  printf("    Stack:     %d regions, ops: %lu\n", regions_stack, InstrCount[0]);
+  printf("    Stack:     %d regions, ops: %lu\n", regions_stack, InstrRead(0));
   
   Image seg3 = ImageCopy(base);
   InstrReset();
   int regions_queue = ImageSegmentation(seg3, ImageRegionFillingWithQUEUE);
-  printf("    Queue:     %d regions, ops: %lu\n", regions_queue, InstrCount[0]);
+  printf("    Queue:     %d regions, ops: %lu\n", regions_queue, InstrRead(0));
   
   TEST_ASSERT(regions_rec == regions_stack, "Recursive == Stack (region count)");
   TEST_ASSERT(regions_stack == regions_queue, "Stack == Queue (region count)");
@@ -463,17 +865,25 @@ void test_segmentation_comparison() {
   seg1 = ImageCopy(base);
   InstrReset();
   regions_rec = ImageSegmentation(seg1, ImageRegionFillingRecursive);
-  printf("    Recursive: %d regions, ops: %lu\n", regions_rec, InstrCount[0]);
+  printf("    Recursive: %d regions, ops: %lu\n", regions_rec, InstrRead(0));
   
   seg2 = ImageCopy(base);
   InstrReset();
   regions_stack = ImageSegmentation(seg2, ImageRegionFillingWithSTACK);
-  printf("    Stack:     %d regions, ops: %lu\n", regions_stack, InstrCount[0]);
+  printf("    Stack:     %d regions, ops: %lu\n", regions_stack, InstrRead(0));
   
   seg3 = ImageCopy(base);
   InstrReset();
   regions_queue = ImageSegmentation(seg3, ImageRegionFillingWithQUEUE);
-  printf("    Queue:     %d regions, ops: %lu\n", regions_queue, InstrCount[0]);
+  printf("    Queue:     %d regions, ops: %lu\n", regions_queue, InstrRead(0));
+  
+  Image seg4 = ImageCopy(base);
+  InstrReset();
+  int regions_scan = ImageSegmentation(seg4, ImageRegionFillingScanline);
+  printf("    Scanline:  %d regions, ops: %lu\n", regions_scan, InstrRead(0));
+  TEST_ASSERT(regions_scan == regions_queue && ImageIsEqual(seg3, seg4),
+              "Scanline == Queue (complex)");
+  ImageDestroy(&seg4);
   
   TEST_ASSERT(regions_rec == regions_stack, "Recursive == Stack (complex)");
   TEST_ASSERT(regions_stack == regions_queue, "Stack == Queue (complex)");
@@ -569,6 +979,943 @@ void test_image_segmentation() {
   TEST_END();
 }
 
+void test_segmentation_union_find() {
+  TEST_START("Two-Pass Union-Find Segmentation");
+
+  // Random noise has regions of every shape, merged in many places
+  Image noise = CreateRandomBW(100, 80, 40, 1234, "img/noise.pbm");
+  TEST_ASSERT(noise != NULL, "Random BW image created");
+  if (noise != NULL) {
+    Image noise_copy = ImageCopy(noise);
+    int r1 = ImageSegmentationUnionFind(noise);
+    int r2 = ImageSegmentation(noise_copy, ImageRegionFillingWithSTACK);
+    printf("  → Noise 100x80: %d regions\n", r1);
+    TEST_ASSERT(r1 == r2 && r1 > 100, "Same number of regions as flood fill");
+    TEST_ASSERT(ImageColors(noise) == ImageColors(noise_copy), "Same number of LUT entries");
+    TEST_ASSERT(ImageIsEqual(noise, noise_copy), "Same labels and colors as flood fill");
+    ImageDestroy(&noise);
+    ImageDestroy(&noise_copy);
+  }
+
+  // More regions than LUT entries: the last ones stay WHITE
+  Image chess = ImageCreateChess(400, 400, 8, 0x000000);
+  Image chess_copy = ImageCopy(chess);
+  int r3 = ImageSegmentationUnionFind(chess);
+  int r4 = ImageSegmentation(chess_copy, ImageRegionFillingWithSTACK);
+  TEST_ASSERT(r3 == r4, "Same number of regions when the LUT fills up");
+  TEST_ASSERT(ImageIsEqual(chess, chess_copy), "Same image when the LUT fills up");
+  ImageDestroy(&chess);
+  ImageDestroy(&chess_copy);
+
+  // Parallel bands must give the same labels as a serial scan
+  Image rnd = CreateRandomBW(600, 600, 20, 99, "img/noise.pbm");
+  if (rnd != NULL) {
+    Image rnd_serial = ImageCopy(rnd);
+    Image rnd_fill = ImageCopy(rnd);
+    ImageSetThreads(4);
+    int rp = ImageSegmentationUnionFind(rnd);
+    ImageSetThreads(1);
+    int rs = ImageSegmentationUnionFind(rnd_serial);
+    ImageSetThreads(0);
+    int rf = ImageSegmentation(rnd_fill, ImageRegionFillingWithSTACK);
+    printf("  → Noise 600x600: %d regions\n", rp);
+    TEST_ASSERT(rp == rs && rp == rf, "Parallel bands find the same regions");
+    TEST_ASSERT(ImageIsEqual(rnd, rnd_serial) && ImageIsEqual(rnd, rnd_fill),
+                "Parallel bands give the same labels");
+    ImageDestroy(&rnd);
+    ImageDestroy(&rnd_serial);
+    ImageDestroy(&rnd_fill);
+  }
+
+  // Cost on a large image
+  Image big = ImageCreateChess(2000, 2000, 100, 0x000000);
+  Image big_copy = ImageCopy(big);
+  InstrReset();
+  int r5 = ImageSegmentation(big, ImageRegionFillingWithSTACK);
+  printf("  → Chess 2000x2000, flood fill: %d regions, ops: %lu\n", r5, InstrRead(0));
+  InstrPrint();
+  InstrReset();
+  int r6 = ImageSegmentationUnionFind(big_copy);
+  printf("  → Chess 2000x2000, union-find: %d regions, ops: %lu\n", r6, InstrRead(0));
+  InstrPrint();
+  TEST_ASSERT(r5 == r6 && ImageIsEqual(big, big_copy), "Same result on a large image");
+  ImageDestroy(&big);
+  ImageDestroy(&big_copy);
+
+  TEST_END();
+}
+
+void test_segmentation_runs() {
+  TEST_START("Run-Length Segmentation");
+
+  // Odd widths exercise the ends of the word-at-a-time run search
+  uint32 widths[3] = {97, 203, 256};
+  for (int i = 0; i < 3; i++) {
+    Image rnd = CreateRandomBW(widths[i], 90, 25, 7 + i, "img/noise.pbm");
+    if (rnd == NULL) continue;
+    Image rnd_copy = ImageCopy(rnd);
+    int r1 = ImageSegmentationRuns(rnd);
+    int r2 = ImageSegmentation(rnd_copy, ImageRegionFillingWithSTACK);
+    printf("  → Noise %ux90: %d regions\n", widths[i], r1);
+    TEST_ASSERT(r1 == r2 && ImageIsEqual(rnd, rnd_copy),
+                "Run labeling gives the same result as flood fill");
+    ImageDestroy(&rnd);
+    ImageDestroy(&rnd_copy);
+  }
+
+  // Long runs: work follows the runs, not the pixels
+  Image big = ImageCreateChess(2000, 2000, 100, 0x000000);
+  Image big_copy = ImageCopy(big);
+  InstrReset();
+  int r3 = ImageSegmentationUnionFind(big);
+  printf("  → Chess 2000x2000, union-find: %d regions\n", r3);
+  InstrPrint();
+  InstrReset();
+  int r4 = ImageSegmentationRuns(big_copy);
+  printf("  → Chess 2000x2000, runs: %d regions\n", r4);
+  InstrPrint();
+  TEST_ASSERT(r3 == r4 && ImageIsEqual(big, big_copy), "Same result on a large image");
+  ImageDestroy(&big);
+  ImageDestroy(&big_copy);
+
+  TEST_END();
+}
+
+void test_segmentation_stats() {
+  TEST_START("Segmentation with Region Statistics");
+
+  Image chess = ImageCreateChess(40, 30, 10, 0x000000);
+  RegionInfo* regions = NULL;
+  int n = ImageSegmentationWithStats(chess, &regions);
+  TEST_ASSERT(n == 6 && regions != NULL, "One descriptor per WHITE square");
+  if (regions != NULL) {
+    TEST_ASSERT(regions[0].label == 2 && regions[0].area == 100,
+                "First region has the first new label and 100 pixels");
+    TEST_ASSERT(regions[0].seed_u == 10 && regions[0].seed_v == 0,
+                "Seed is the first pixel in raster order");
+    TEST_ASSERT(regions[1].seed_u == 30 && regions[1].box.umin == 30 &&
+                    regions[1].box.umax == 39 && regions[1].box.vmax == 9,
+                "Second region has the second square's seed and box");
+    TEST_ASSERT(regions[5].cu == 34.5 && regions[5].cv == 24.5,
+                "Centroid is the square's center");
+  }
+  free(regions);
+  ImageDestroy(&chess);
+
+  // Descriptors agree with a separate histogram pass
+  Image rnd = CreateRandomBW(150, 120, 25, 42, "img/noise.pbm");
+  if (rnd != NULL) {
+    Image rnd_copy = ImageCopy(rnd);
+    n = ImageSegmentationWithStats(rnd, &regions);
+    int r = ImageSegmentation(rnd_copy, ImageRegionFillingWithSTACK);
+    TEST_ASSERT(n == r && ImageIsEqual(rnd, rnd_copy), "Same labels as ImageSegmentation");
+
+    uint32* counts = malloc(ImageColors(rnd) * sizeof(uint32));
+    LabelBox* boxes = malloc(ImageColors(rnd) * sizeof(LabelBox));
+    ImageLabelHistogram(rnd, counts, boxes);
+    int agree = 1;
+    for (int i = 0; i < n; i++) {
+      uint16 l = regions[i].label;
+      agree = agree && regions[i].area == counts[l] &&
+              memcmp(&regions[i].box, &boxes[l], sizeof(LabelBox)) == 0;
+    }
+    TEST_ASSERT(agree, "Areas and boxes equal the label histogram");
+    free(counts);
+    free(boxes);
+    free(regions);
+    ImageDestroy(&rnd);
+    ImageDestroy(&rnd_copy);
+  }
+
+  TEST_END();
+}
+
+void test_incremental_segmentation() {
+  TEST_START("Incremental Segmentation");
+
+  // Partitions compare regions, not labels
+  Image chess = ImageCreateChess(40, 40, 10, 0x000000);
+  Image chess_seg = ImageCopy(chess);
+  ImageSegmentation(chess_seg, ImageRegionFillingWithSTACK);
+  TEST_ASSERT(!ImageIsSamePartition(chess, chess_seg),
+              "Segmented chess splits the WHITE background");
+  Image plain = ImageCreate(40, 40);
+  Image plain_seg = ImageCopy(plain);
+  ImageSegmentation(plain_seg, ImageRegionFillingWithSTACK);
+  TEST_ASSERT(ImageIsSamePartition(plain, plain_seg) && !ImageIsEqual(plain, plain_seg),
+              "Relabeled blank image has the same partition");
+  TEST_ASSERT(!ImageIsSamePartition(chess, plain), "Chess and blank differ");
+  ImageDestroy(&chess);
+  ImageDestroy(&chess_seg);
+  ImageDestroy(&plain);
+  ImageDestroy(&plain_seg);
+
+  // A line across a blank image splits it; erasing one pixel merges it
+  Image blank = ImageCreate(50, 40);
+  Segmentation seg = SegmentationCreate(blank);
+  TEST_ASSERT(SegmentationRegions(seg) == 1, "Blank image has one region");
+  uint16 label = 2;
+  TEST_ASSERT(SegmentationArea(seg, label) == 2000, "Region has every pixel");
+  PixelCoords line[40];
+  for (int v = 0; v < 40; v++) line[v] = PixelCoordsCreate(20, v);
+  SegmentationUpdate(seg, line, 40, BLACK);
+  TEST_ASSERT(SegmentationRegions(seg) == 2, "Vertical line splits the region");
+  TEST_ASSERT(SegmentationArea(seg, label) + SegmentationArea(seg, 3) == 1960,
+              "Pieces share the remaining pixels");
+  TEST_ASSERT(SegmentationArea(seg, label) == 1160 || SegmentationArea(seg, label) == 800,
+              "Pieces have the sizes of both sides");
+  uint32 changed = SegmentationUpdate(seg, &line[10], 1, WHITE);
+  TEST_ASSERT(SegmentationRegions(seg) == 1, "Erasing a line pixel merges the pieces");
+  TEST_ASSERT(changed == 801, "Only the smaller piece is relabeled");
+  SegmentationDestroy(&seg);
+  TEST_ASSERT(seg == NULL, "SegmentationDestroy sets pointer to NULL");
+  ImageDestroy(&blank);
+
+  // Random strokes and erasures match a full segmentation every time
+  uint32 w = 120, h = 90;
+  unsigned char* black = malloc(w * h);
+  RandomMask(black, w * h, 20, 2024);
+  Image img = CreateBW(black, w, h, "img/incremental.pbm");
+  seg = SegmentationCreate(img);
+  unsigned rnd = 77;
+  int all_same = 1;
+  int all_counts = 1;
+  for (int round = 0; round < 40; round++) {
+    PixelCoords edits[30];
+    int n = 0;
+    rnd = rnd * 1103515245u + 12345u;
+    uint32 u0 = (rnd >> 8) % w;
+    rnd = rnd * 1103515245u + 12345u;
+    uint32 v0 = (rnd >> 8) % h;
+    uint16 value = round % 3 == 2 ? WHITE : BLACK;
+    // A stroke: a horizontal or vertical segment
+    for (int i = 0; i < 30; i++) {
+      uint32 u = round % 2 ? (u0 + i) % w : u0;
+      uint32 v = round % 2 ? v0 : (v0 + i) % h;
+      edits[n++] = PixelCoordsCreate((int)u, (int)v);
+      black[v * w + u] = value == BLACK;
+    }
+    SegmentationUpdate(seg, edits, n, value);
+
+    Image ref = CreateBW(black, w, h, "img/incremental.pbm");
+    int regions = ImageSegmentation(ref, ImageRegionFillingWithSTACK);
+    all_same = all_same && ImageIsSamePartition(img, ref);
+    all_counts = all_counts && regions == SegmentationRegions(seg);
+    ImageDestroy(&ref);
+  }
+  TEST_ASSERT(all_same, "Updated regions equal a full segmentation");
+  TEST_ASSERT(all_counts, "Region count equals a full segmentation");
+  printf("  → %d regions after 40 edits\n", SegmentationRegions(seg));
+  SegmentationDestroy(&seg);
+  ImageDestroy(&img);
+  free(black);
+
+  // More regions than the LUT holds
+  Image pixels = ImageCreateChess(64, 64, 1, 0x000000);
+  seg = SegmentationCreate(pixels);
+  TEST_ASSERT(seg == NULL, "Too many regions: no segmentation");
+  ImageDestroy(&pixels);
+
+  // A full LUT: 997 single pixels and a 3-pixel segment in row 0,
+  // above a BLACK row
+  w = 1997;
+  h = 2;
+  black = malloc(w * h);
+  for (uint32 i = 0; i < w * h; i++) black[i] = i >= w || (i % 2 && i < 1994);
+  img = CreateBW(black, w, h, "img/incremental.pbm");
+  seg = SegmentationCreate(img);
+  TEST_ASSERT(seg != NULL && SegmentationRegions(seg) == 998, "LUT is full");
+  Image before = ImageCopy(img);
+  PixelCoords cut = PixelCoordsCreate(1995, 0);
+  PixelCoords hole = PixelCoordsCreate(1, 1);
+  PixelCoords dot = PixelCoordsCreate(0, 0);
+  TEST_ASSERT(SegmentationUpdate(seg, &cut, 1, BLACK) == SEGMENTATION_LUT_FULL,
+              "Splitting with a full LUT fails");
+  TEST_ASSERT(SegmentationUpdate(seg, &hole, 1, WHITE) == SEGMENTATION_LUT_FULL,
+              "Erasing a new region with a full LUT fails");
+  TEST_ASSERT(ImageIsEqual(img, before) && SegmentationRegions(seg) == 998 &&
+                  SegmentationArea(seg, 999) == 3,
+              "Failed updates change nothing");
+  TEST_ASSERT(SegmentationUpdate(seg, &dot, 1, BLACK) == 1,
+              "Drawing over a region frees its label");
+  TEST_ASSERT(SegmentationUpdate(seg, &cut, 1, BLACK) == 2 &&
+                  SegmentationRegions(seg) == 998,
+              "Splitting reuses the freed label");
+  SegmentationDestroy(&seg);
+  ImageDestroy(&before);
+  ImageDestroy(&img);
+  free(black);
+
+  TEST_END();
+}
+
+void test_streaming_segmentation() {
+  TEST_START("Streaming Segmentation");
+
+  // Square image and tall strip, read in bands of a few rows
+  uint32 widths[2] = {120, 40};
+  uint32 heights[2] = {100, 2000};
+  for (int i = 0; i < 2; i++) {
+    Image img = CreateRandomBW(widths[i], heights[i], 25, 31 + i, "img/stream.pbm");
+    if (img == NULL) continue;
+    int r1 = ImageSegmentationStreamPBM("img/stream.pbm", "img/stream.ppm", 7);
+    int r2 = ImageSegmentation(img, ImageRegionFillingWithSTACK);
+    printf("  → Noise %ux%u: %d regions\n", widths[i], heights[i], r1);
+    TEST_ASSERT(r1 == r2, "Streaming finds the same regions");
+    Image streamed = ImageLoadPPM("img/stream.ppm");
+    TEST_ASSERT(ImageIsEqual(img, streamed), "Streamed file equals the segmented image");
+    ImageDestroy(&streamed);
+    ImageDestroy(&img);
+  }
+
+  // Tall image with many small regions: the sets kept depend on the width
+  Image tall = CreateRandomBW(32, 20000, 55, 41, "img/stream.pbm");
+  if (tall != NULL) {
+    int r1 = ImageSegmentationStreamPBM("img/stream.pbm", "img/stream.ppm", 64);
+    int r2 = ImageSegmentation(tall, ImageRegionFillingWithSTACK);
+    uint32 peak = ImageSegmentationStreamPeakSets();
+    printf("  → Noise 32x20000: %d regions, at most %u sets\n", r1, peak);
+    TEST_ASSERT(r1 == r2, "Streaming finds the same regions");
+    TEST_ASSERT(peak > 0 && peak <= 32 + 1, "Sets kept are bounded by the width");
+    Image streamed = ImageLoadPPM("img/stream.ppm");
+    TEST_ASSERT(ImageIsEqual(tall, streamed), "Streamed file equals the segmented image");
+    ImageDestroy(&streamed);
+    ImageDestroy(&tall);
+  }
+
+  TEST_END();
+}
+
+void test_region_adjacency() {
+  TEST_START("Region Adjacency Graph");
+
+  // A grid of one-pixel lines: 4x3 cells of 9x9 pixels
+  uint32 w = 41, h = 31;
+  unsigned char* black = malloc(w * h);
+  for (uint32 y = 0; y < h; y++) {
+    for (uint32 x = 0; x < w; x++) black[y * w + x] = x % 10 == 0 || y % 10 == 0;
+  }
+  Image grid = CreateBW(black, w, h, "img/grid.pbm");
+  free(black);
+  int cells = ImageSegmentation(grid, ImageRegionFillingWithSTACK);
+  TEST_ASSERT(cells == 12, "Grid has 12 cells");
+
+  RegionAdjacency* touching = ImageRegionAdjacency(grid, 0);
+  TEST_ASSERT(touching->offsets[touching->num_labels] == 0, "Cells do not touch directly");
+  RegionAdjacencyDestroy(&touching);
+  TEST_ASSERT(touching == NULL, "RegionAdjacencyDestroy sets pointer to NULL");
+
+  RegionAdjacency* graph = ImageRegionAdjacency(grid, 1);
+  TEST_ASSERT(graph->num_labels == ImageColors(grid), "One node per label");
+  TEST_ASSERT(graph->offsets[graph->num_labels] == 34, "17 adjacencies, listed twice");
+  // Cell labels are 2 + 4 * row + column
+  uint32* o = graph->offsets;
+  TEST_ASSERT(o[3] - o[2] == 2 && graph->neighbors[o[2]] == 3 &&
+                  graph->neighbors[o[2] + 1] == 6,
+              "Corner cell touches its right and lower cells");
+  TEST_ASSERT(o[8] - o[7] == 4 && graph->neighbors[o[7]] == 3 &&
+                  graph->neighbors[o[7] + 3] == 11,
+              "Inner cell touches four cells");
+  RegionAdjacencyDestroy(&graph);
+  ImageDestroy(&grid);
+
+  // Parallel bands give the same graph as a single band
+  Image rnd = CreateRandomBW(400, 400, 25, 5, "img/noise.pbm");
+  ImageSegmentationRuns(rnd);
+  ImageSetThreads(1);
+  RegionAdjacency* serial = ImageRegionAdjacency(rnd, 2);
+  ImageSetThreads(4);
+  RegionAdjacency* parallel = ImageRegionAdjacency(rnd, 2);
+  ImageSetThreads(0);
+  uint32 nodes = serial->num_labels;
+  TEST_ASSERT(memcmp(serial->offsets, parallel->offsets, (nodes + 1) * sizeof(uint32)) == 0 &&
+                  memcmp(serial->neighbors, parallel->neighbors,
+                         serial->offsets[nodes] * sizeof(uint16)) == 0,
+              "Parallel graph equals serial graph");
+  printf("  → Noise 400x400: %u regions, %u adjacencies\n", nodes - 2,
+         serial->offsets[nodes] / 2);
+  RegionAdjacencyDestroy(&serial);
+  RegionAdjacencyDestroy(&parallel);
+  ImageDestroy(&rnd);
+
+  TEST_END();
+}
+
+// Area enclosed by a chain code (positive if clockwise).
+static long ChainArea(const ChainCode* c) {
+  static const int dx[4] = {1, 0, -1, 0};
+  static const int dy[4] = {0, 1, 0, -1};
+  long x = c->u, y = c->v, area = 0;
+  for (uint32 i = 0; i < c->length; i++) {
+    int d = (c->codes[i / 4] >> (2 * (i % 4))) & 3;
+    area += x * dy[d];  // x * (y1 - y0)
+    x += dx[d];
+    y += dy[d];
+  }
+  return area;
+}
+
+void test_region_contours() {
+  TEST_START("Region Contour Tracing");
+
+  // A one-pixel square ring: the background has one hole
+  uint32 w = 20, h = 20;
+  unsigned char* black = calloc(w * h, 1);
+  for (uint32 i = 5; i <= 14; i++) {
+    black[5 * w + i] = black[14 * w + i] = black[i * w + 5] = black[i * w + 14] = 1;
+  }
+  Image ring = CreateBW(black, w, h, "img/ring.pbm");
+  free(black);
+  ImageSegmentation(ring, ImageRegionFillingWithSTACK);
+
+  RegionContours* outside = ImageRegionContours(ring, 0, 0, 1);
+  TEST_ASSERT(outside->label == 2 && outside->outer.length == 80,
+              "Outer contour follows the image border");
+  TEST_ASSERT(ChainArea(&outside->outer) == 400, "Outer contour is clockwise");
+  TEST_ASSERT(outside->num_holes == 1 && outside->holes[0].length == 40,
+              "One hole around the ring");
+  TEST_ASSERT(ChainArea(&outside->holes[0]) == -100, "Hole contour is counterclockwise");
+  RegionContoursDestroy(&outside);
+  TEST_ASSERT(outside == NULL, "RegionContoursDestroy sets pointer to NULL");
+
+  RegionContours* inside = ImageRegionContours(ring, 6, 6, 1);
+  TEST_ASSERT(inside->label == 3 && inside->outer.length == 32 && inside->num_holes == 0,
+              "Inner region has a 8x8 contour and no holes");
+  RegionContoursDestroy(&inside);
+  ImageDestroy(&ring);
+
+  // Contours enclose exactly the pixels of each region
+  Image rnd = CreateRandomBW(160, 120, 35, 11, "img/noise.pbm");
+  RegionInfo* regions = NULL;
+  int n = ImageSegmentationWithStats(rnd, &regions);
+  int areas_ok = 1;
+  uint32 holes = 0;
+  for (int i = 0; i < n; i++) {
+    RegionContours* rc = ImageRegionContours(rnd, regions[i].seed_u, regions[i].seed_v, 1);
+    long area = ChainArea(&rc->outer);
+    for (uint32 j = 0; j < rc->num_holes; j++) area += ChainArea(&rc->holes[j]);
+    areas_ok = areas_ok && rc->label == regions[i].label && area == (long)regions[i].area;
+    holes += rc->num_holes;
+    RegionContoursDestroy(&rc);
+  }
+  printf("  → Noise 160x120: %d regions, %u holes\n", n, holes);
+  TEST_ASSERT(areas_ok, "Outer minus hole areas equal each region's area");
+  free(regions);
+  ImageDestroy(&rnd);
+
+  TEST_END();
+}
+
+// Dilate (or erode) a mask by a square of radius r, pixel by pixel.
+// Pixels outside count as WHITE when dilating and BLACK when eroding.
+static void NaiveMorphology(const unsigned char* src, unsigned char* dst,
+                            uint32 w, uint32 h, int r, int erode) {
+  for (int y = 0; y < (int)h; y++) {
+    for (int x = 0; x < (int)w; x++) {
+      int any = 0, all = 1;
+      for (int dy = -r; dy <= r; dy++) {
+        for (int dx = -r; dx <= r; dx++) {
+          int xx = x + dx, yy = y + dy;
+          int outside = xx < 0 || yy < 0 || xx >= (int)w || yy >= (int)h;
+          int b = outside ? erode : src[yy * w + xx];
+          any |= b;
+          all &= b;
+        }
+      }
+      dst[y * w + x] = erode ? all : any;
+    }
+  }
+}
+
+void test_morphology() {
+  TEST_START("Bit-Packed Morphology");
+
+  // A single BLACK pixel grows into a square and shrinks back
+  uint32 counts[2];
+  unsigned char dot[11 * 11] = {0};
+  dot[5 * 11 + 5] = 1;
+  Image img = CreateBW(dot, 11, 11, "img/morph.pbm");
+  ImageDilate(img, 2);
+  ImageLabelHistogram(img, counts, NULL);
+  TEST_ASSERT(counts[BLACK] == 25, "Dilating a pixel by 2 gives a 5x5 square");
+  ImageErode(img, 2);
+  ImageLabelHistogram(img, counts, NULL);
+  TEST_ASSERT(counts[BLACK] == 1, "Eroding the square gives the pixel back");
+  ImageOpen(img, 1);
+  ImageLabelHistogram(img, counts, NULL);
+  TEST_ASSERT(counts[BLACK] == 0, "Opening removes an isolated pixel");
+  ImageDestroy(&img);
+
+  // Closing a one-pixel gap in a contour separates the two sides
+  unsigned char wall[21 * 21] = {0};
+  for (int y = 0; y < 21; y++) wall[y * 21 + 10] = y != 10;
+  img = CreateBW(wall, 21, 21, "img/morph.pbm");
+  Image closed = ImageCopy(img);
+  ImageClose(closed, 1);
+  TEST_ASSERT(ImageSegmentation(img, ImageRegionFillingWithSTACK) == 1,
+              "Gap in the wall joins both sides");
+  TEST_ASSERT(ImageSegmentation(closed, ImageRegionFillingWithSTACK) == 2,
+              "Closed wall separates both sides");
+  ImageDestroy(&img);
+  ImageDestroy(&closed);
+
+  // Word-wide passes equal pixel-by-pixel operators, across word borders
+  uint32 w = 330, h = 400;  // two bands with 4 threads
+  unsigned char* src = malloc(w * h);
+  unsigned char* tmp = malloc(w * h);
+  unsigned char* ref = malloc(w * h);
+  RandomMask(src, w * h, 30, 3);
+  int all_ok = 1;
+  for (int r = 1; r <= 3; r++) {
+    for (int op = 0; op < 4; op++) {
+      Image got = CreateBW(src, w, h, "img/morph.pbm");
+      ImageSetThreads(op % 2 ? 4 : 1);
+      switch (op) {
+        case 0:
+          ImageDilate(got, r);
+          NaiveMorphology(src, ref, w, h, r, 0);
+          break;
+        case 1:
+          ImageErode(got, r);
+          NaiveMorphology(src, ref, w, h, r, 1);
+          break;
+        case 2:
+          ImageOpen(got, r);
+          NaiveMorphology(src, tmp, w, h, r, 1);
+          NaiveMorphology(tmp, ref, w, h, r, 0);
+          break;
+        case 3:
+          ImageClose(got, r);
+          NaiveMorphology(src, tmp, w, h, r, 0);
+          NaiveMorphology(tmp, ref, w, h, r, 1);
+          break;
+      }
+      Image expected = CreateBW(ref, w, h, "img/morph.pbm");
+      all_ok = all_ok && ImageIsEqual(got, expected);
+      ImageDestroy(&got);
+      ImageDestroy(&expected);
+    }
+  }
+  ImageSetThreads(0);
+  TEST_ASSERT(all_ok, "Dilate, erode, open and close equal the naive operators");
+  free(src);
+  free(tmp);
+  free(ref);
+
+  TEST_END();
+}
+
+void test_simd_kernels() {
+  TEST_START("SIMD Kernel Dispatch");
+
+  const ImageKernels* scalar = KernelsGet(KERNELS_SCALAR);
+  TEST_ASSERT(scalar != NULL, "Scalar kernels are always available");
+  TEST_ASSERT(Kernels == KernelsGet(Kernels->level),
+              "ImageInit selected a supported level");
+  printf("  Detected level: %s, selected: %s\n",
+         KernelsGet(KernelsDetect())->name, Kernels->name);
+
+  // Rows of few labels with long runs, across every vector width and tail
+  enum { MAXN = 300 };
+  uint16 row[MAXN], a[MAXN], b[MAXN];
+  uint16 map[8] = {3, 0, 6, 1, 4, 2, 5, 0};  // one entry past label 6
+  unsigned int seed = 7;
+  for (int l = KERNELS_SSE2; l <= KERNELS_AVX2; l++) {
+    const ImageKernels* k = KernelsGet(l);
+    if (k == NULL) {
+      printf("  Level %d not supported, skipped\n", l);
+      continue;
+    }
+    int ok_find = 1, ok_remap = 1, ok_pack = 1, ok_unpack = 1, ok_hist = 1;
+    for (uint32 n = 0; n < MAXN; n += (n < 70 ? 1 : 23)) {
+      uint16 label = 0;
+      for (uint32 j = 0; j < n; j++) {
+        seed = seed * 1103515245u + 12345u;
+        if ((seed >> 16) % 16 == 0) label = (uint16)((seed >> 8) % 7);
+        row[j] = label;
+      }
+      for (uint32 from = 0; from < n; from += 5) {
+        for (uint16 v = 0; v < 7; v++) {
+          ok_find = ok_find &&
+                    k->run_end(row, from, n, v) ==
+                        scalar->run_end(row, from, n, v) &&
+                    k->find(row, from, n, v) == scalar->find(row, from, n, v);
+        }
+      }
+
+      memcpy(a, row, sizeof(row));
+      memcpy(b, row, sizeof(row));
+      k->remap(a, n, map);
+      scalar->remap(b, n, map);
+      ok_remap = ok_remap && memcmp(a, b, n * sizeof(uint16)) == 0;
+
+      uint64_t bits_a[MAXN / 64 + 1] = {0}, bits_b[MAXN / 64 + 1] = {0};
+      k->pack(row, n, BLACK, bits_a);
+      scalar->pack(row, n, BLACK, bits_b);
+      ok_pack = ok_pack && memcmp(bits_a, bits_b, sizeof(bits_a)) == 0;
+
+      for (uint32 w = 0; w < MAXN / 64 + 1; w++) {
+        seed = seed * 1103515245u + 12345u;
+        bits_a[w] = (uint64_t)seed * 0x9e3779b97f4a7c15ull;
+      }
+      memcpy(a, row, sizeof(row));
+      memcpy(b, row, sizeof(row));
+      k->unpack(a, n, bits_a, BLACK, WHITE);
+      scalar->unpack(b, n, bits_a, BLACK, WHITE);
+      ok_unpack = ok_unpack && memcmp(a, b, n * sizeof(uint16)) == 0;
+
+      uint32 ha[4][7] = {{0}}, hb[4][7] = {{0}};
+      uint32* const sa[4] = {ha[0], ha[1], ha[2], ha[3]};
+      uint32* const sb[4] = {hb[0], hb[1], hb[2], hb[3]};
+      k->histogram(row, n, sa);
+      scalar->histogram(row, n, sb);
+      for (int c = 0; c < 7; c++) {
+        ok_hist = ok_hist && ha[0][c] + ha[1][c] + ha[2][c] + ha[3][c] ==
+                                 hb[0][c] + hb[1][c] + hb[2][c] + hb[3][c];
+      }
+    }
+    int ok_transpose = 1;
+    for (uint32 rows = 1; rows <= 19; rows += 6) {
+      for (uint32 cols = 1; cols <= 45; cols += 11) {
+        uint16 src[19][45], dst_a[45][19], dst_b[45][19];
+        const uint16* src_rows[19];
+        uint16 *rows_a[45], *rows_b[45];
+        for (uint32 i = 0; i < rows; i++) {
+          for (uint32 j = 0; j < cols; j++) src[i][j] = (uint16)(i * 64 + j);
+          src_rows[i] = src[i];
+        }
+        for (uint32 j = 0; j < cols; j++) {
+          rows_a[j] = dst_a[j];
+          rows_b[j] = dst_b[j];
+        }
+        k->transpose(rows_a, src_rows, rows, cols);
+        scalar->transpose(rows_b, src_rows, rows, cols);
+        for (uint32 j = 0; j < cols; j++) {
+          ok_transpose = ok_transpose &&
+                         memcmp(dst_a[j], dst_b[j], rows * sizeof(uint16)) == 0;
+        }
+      }
+    }
+    printf("  Level %s:\n", k->name);
+    TEST_ASSERT(ok_transpose, "Transpose equals the scalar kernel");
+    TEST_ASSERT(ok_find, "Run end and find equal the scalar kernels");
+    TEST_ASSERT(ok_remap, "Label remap equals the scalar kernel");
+    TEST_ASSERT(ok_pack, "Bit pack equals the scalar kernel");
+    TEST_ASSERT(ok_unpack, "Bit unpack equals the scalar kernel");
+    TEST_ASSERT(ok_hist, "Histogram equals the scalar kernel");
+  }
+
+  // Whole operations give the same images at every level
+  const ImageKernels* selected = Kernels;
+  Image reference[4] = {NULL};
+  int ok_images = 1;
+  for (int l = KERNELS_SCALAR; l <= KERNELS_AVX2; l++) {
+    if (KernelsGet(l) == NULL) continue;
+    Kernels = KernelsGet(l);
+    Image noise = CreateRandomBW(83, 61, 40, 11, "img/noise.pbm");
+    Image results[4];
+    results[0] = ImageRotate90CW(noise);
+    results[1] = ImageCopy(noise);
+    ImageDilate(results[1], 2);
+    results[2] = ImageCopy(noise);
+    ImageSegmentationRuns(results[2]);
+    results[3] = ImageCopy(results[2]);
+    ImageCompactLUT(results[3]);
+    for (int r = 0; r < 4; r++) {
+      if (reference[r] == NULL) {
+        reference[r] = results[r];
+      } else {
+        ok_images = ok_images && ImageIsEqual(reference[r], results[r]);
+        ImageDestroy(&results[r]);
+      }
+    }
+    ImageDestroy(&noise);
+  }
+  Kernels = selected;
+  TEST_ASSERT(ok_images,
+              "Rotation, dilation, segmentation and compaction agree at all "
+              "levels");
+  for (int r = 0; r < 4; r++) ImageDestroy(&reference[r]);
+
+  TEST_END();
+}
+
+// A fork-join sum over a[0..n), as a task graph of halves
+struct sumJob {
+  const uint32* a;
+  size_t n;
+  uint64_t sum;
+};
+
+static void SumTask(void* arg, int task) {
+  struct sumJob* job = (struct sumJob*)arg + task;
+  if (job->n <= 1000) {
+    job->sum = 0;
+    for (size_t i = 0; i < job->n; i++) job->sum += job->a[i];
+    return;
+  }
+  size_t half = job->n / 2;
+  struct sumJob halves[2] = {{job->a, half, 0},
+                             {job->a + half, job->n - half, 0}};
+  TaskGroup group;
+  PoolGroupInit(&group);
+  PoolSpawn(&group, SumTask, halves, 1);
+  SumTask(halves, 0);
+  PoolWait(&group);
+  PoolGroupDestroy(&group);
+  job->sum = halves[0].sum + halves[1].sum;
+}
+
+// A client thread running operations on its own images
+struct poolClient {
+  Image img, segmented, dilated;
+  uint32 counts[2];
+};
+
+static void* PoolClientMain(void* p) {
+  struct poolClient* c = p;
+  c->segmented = ImageCopy(c->img);
+  ImageSegmentationUnionFind(c->segmented);
+  c->dilated = ImageCopy(c->img);
+  ImageDilate(c->dilated, 1);
+  ImageLabelHistogram(c->dilated, c->counts, NULL);
+  return NULL;
+}
+
+void test_thread_pool() {
+  TEST_START("Work-Stealing Thread Pool");
+
+  ImageSetThreads(4);
+  TEST_ASSERT(PoolWorkers() == 3, "Four threads are the caller and 3 workers");
+
+  // Nested spawns (a task graph) with stealing among the workers
+  size_t n = 1 << 18;
+  uint32* a = malloc(n * sizeof(uint32));
+  uint64_t expected = 0;
+  for (size_t i = 0; i < n; i++) {
+    a[i] = (uint32)(i * 2654435761u >> 7);
+    expected += a[i];
+  }
+  struct sumJob job = {a, n, 0};
+  PoolRun(1, SumTask, &job);
+  TEST_ASSERT(job.sum == expected, "Fork-join task graph sums correctly");
+
+  // Without workers, everything runs on the calling thread
+  ImageSetThreads(1);
+  TEST_ASSERT(PoolWorkers() == 0, "One thread means no workers");
+  job.sum = 0;
+  PoolRun(1, SumTask, &job);
+  TEST_ASSERT(job.sum == expected, "Serial fallback sums correctly");
+  free(a);
+
+  // Concurrent clients on different images, against serial references
+  enum { NCLIENTS = 4 };
+  struct poolClient clients[NCLIENTS];
+  struct poolClient refs[NCLIENTS];
+  for (int c = 0; c < NCLIENTS; c++) {
+    clients[c].img = CreateRandomBW(600, 500, 20, 100 + c, "img/noise.pbm");
+    refs[c].img = clients[c].img;
+    PoolClientMain(&refs[c]);
+  }
+  ImageSetThreads(4);
+  pthread_t threads[NCLIENTS];
+  for (int c = 0; c < NCLIENTS; c++) {
+    pthread_create(&threads[c], NULL, PoolClientMain, &clients[c]);
+  }
+  for (int c = 0; c < NCLIENTS; c++) pthread_join(threads[c], NULL);
+  int same = 1;
+  for (int c = 0; c < NCLIENTS; c++) {
+    same = same &&
+           ImageIsSamePartition(clients[c].segmented, refs[c].segmented) &&
+           ImageIsEqual(clients[c].dilated, refs[c].dilated) &&
+           clients[c].counts[BLACK] == refs[c].counts[BLACK];
+    ImageDestroy(&clients[c].segmented);
+    ImageDestroy(&clients[c].dilated);
+    ImageDestroy(&refs[c].segmented);
+    ImageDestroy(&refs[c].dilated);
+    ImageDestroy(&clients[c].img);
+  }
+  TEST_ASSERT(same, "Concurrent clients get the serial results");
+
+  // After shutdown, operations run serially
+  ImageShutdown();
+  TEST_ASSERT(PoolWorkers() == 0, "Shutdown stops the workers");
+  ImageSetThreads(4);
+  TEST_ASSERT(PoolWorkers() == 0, "Setting threads does not restart the pool");
+  Image chess = ImageCreateChess(300, 300, 10, 0x00ff00);
+  TEST_ASSERT(ImageSegmentationUnionFind(chess) == 450,
+              "Segmentation works without the pool");
+  ImageDestroy(&chess);
+  ImageInit();
+  TEST_ASSERT(PoolWorkers() == 3, "ImageInit restarts the pool");
+  ImageSetThreads(0);
+
+  TEST_END();
+}
+
+// Count task + 1 events, one at a time
+static void CountTask(void* arg, int task) {
+  (void)arg;
+  for (int k = 0; k <= task; k++) InstrCount[2]++;
+}
+
+static void* CountThreadMain(void* arg) {
+  for (int k = 0; k < 1000; k++) InstrCount[2]++;
+  return arg;
+}
+
+void test_thread_counters() {
+  TEST_START("Per-Thread Instrumentation Counters");
+
+  InstrName[2] = "events";
+  ImageSetThreads(4);
+  InstrReset();
+  for (int r = 0; r < 100; r++) PoolRun(64, CountTask, NULL);
+  TEST_ASSERT(InstrRead(2) == 100ul * 64 * 65 / 2,
+              "Counts of pool tasks add up exactly");
+
+  // Counts of finished threads are kept
+  pthread_t threads[3];
+  for (int t = 0; t < 3; t++) {
+    pthread_create(&threads[t], NULL, CountThreadMain, NULL);
+  }
+  for (int t = 0; t < 3; t++) pthread_join(threads[t], NULL);
+  TEST_ASSERT(InstrRead(2) == 100ul * 64 * 65 / 2 + 3000,
+              "Counts of finished threads are kept");
+  InstrPrintThreads();
+
+  // Parallel and serial operations count the same work
+  Image noise = CreateRandomBW(600, 500, 30, 5, "img/noise.pbm");
+  uint32 counts[2];
+  InstrReset();
+  ImageLabelHistogram(noise, counts, NULL);
+  unsigned long parallel = InstrRead(0);
+  ImageSetThreads(1);
+  InstrReset();
+  ImageLabelHistogram(noise, counts, NULL);
+  TEST_ASSERT(InstrRead(0) == parallel, "Parallel and serial pixmem agree");
+  InstrReset();
+  TEST_ASSERT(InstrRead(2) == 0, "Reset clears the counters of all threads");
+  ImageDestroy(&noise);
+  InstrName[2] = NULL;
+  ImageSetThreads(0);
+
+  TEST_END();
+}
+
+void test_lazy_calibration() {
+  TEST_START("Lazy Instrumentation Calibration");
+
+  // Runs first, after ImageInit, before anything needs the CTU
+  TEST_ASSERT(InstrCTU == 1.0, "CTU is not measured at startup");
+
+  setenv("INSTR_CTU", "0.5", 1);
+  TEST_ASSERT(InstrGetCTU() == 0.5 && InstrCTU == 0.5,
+              "INSTR_CTU overrides the CTU");
+  unsetenv("INSTR_CTU");
+
+  // The cached CTU of this CPU model is used instead of calibrating
+  char dir[] = "/tmp/instr_ctu.XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    TEST_ASSERT(0, "Temporary cache directory is created");
+    TEST_END();
+    return;
+  }
+  char cache[64], subdir[64], nested[96];
+  snprintf(cache, sizeof(cache), "%s/instr_ctu", dir);
+  snprintf(subdir, sizeof(subdir), "%s/sub", dir);
+  snprintf(nested, sizeof(nested), "%s/instr_ctu", subdir);
+  FILE* f = fopen(cache, "w");
+  fprintf(f, "0.001 Some Other CPU\n0.375 %s\n", InstrCPUModel());
+  fclose(f);
+  setenv("INSTR_CTU_CACHE", cache, 1);
+  double t0 = cpu_time();
+  TEST_ASSERT(InstrGetCTU() == 0.375, "CTU is loaded from the cache file");
+  TEST_ASSERT(cpu_time() - t0 < 0.05, "Loading the CTU does not calibrate");
+
+  // In a directory that does not exist yet, like a fresh ~/.cache
+  // (INSTR_CTU stands for the measurement, so no loop is run)
+  setenv("INSTR_CTU_CACHE", nested, 1);
+  setenv("INSTR_CTU", "0.25", 1);
+  t0 = cpu_time();
+  InstrCalibrate();
+  TEST_ASSERT(cpu_time() - t0 < 0.05, "INSTR_CTU replaces the calibration loop");
+  unsetenv("INSTR_CTU");
+  char line[256], last[256] = "";
+  char expected[256];
+  snprintf(expected, sizeof(expected), "0.25 %s\n", InstrCPUModel());
+  f = fopen(nested, "r");
+  TEST_ASSERT(f != NULL, "The cache directory is created");
+  if (f != NULL) {
+    TEST_ASSERT(fgets(line, sizeof(line), f) != NULL && strcmp(line, expected) == 0,
+                "The CTU is saved in the new directory");
+    fclose(f);
+  }
+
+  // An explicit calibration measures and rewrites this model's line
+  setenv("INSTR_CTU_CACHE", cache, 1);
+  InstrCalibrate();
+  TEST_ASSERT(InstrCTU != 0.25 && InstrGetCTU() == InstrCTU,
+              "InstrCalibrate measures the CTU");
+  f = fopen(cache, "r");
+  int lines = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    strcpy(last, line);
+    lines++;
+  }
+  fclose(f);
+  TEST_ASSERT(lines == 2, "The cache keeps one line per CPU model");
+  snprintf(expected, sizeof(expected), "%.9g %s\n", InstrCTU, InstrCPUModel());
+  TEST_ASSERT(strcmp(last, expected) == 0, "The measured CTU is cached");
+  unsetenv("INSTR_CTU_CACHE");
+  printf("  CPU: %s, CTU: %f s\n", InstrCPUModel(), InstrCTU);
+
+  remove(nested);
+  rmdir(subdir);
+  remove(cache);
+  rmdir(dir);
+
+  TEST_END();
+}
+
+// Burn some cpu time
+static void BusyTask(void* arg, int task) {
+  volatile uint64_t* sink = arg;
+  uint64_t x = (uint64_t)task + 1;
+  for (int k = 0; k < 20000000; k++) x = x * 6364136223846793005ull + 1;
+  sink[task] = x;
+}
+
+void test_wall_time() {
+  TEST_START("Wall-Clock and Per-Thread Timing");
+
+  // Waiting counts in wall time, not in cpu time
+  InstrReset();
+  struct timespec pause = {0, 50000000};  // 50 ms
+  nanosleep(&pause, NULL);
+  double wall = wall_time() - InstrWallTime;
+  double cpu = cpu_time() - InstrTime;
+  TEST_ASSERT(wall >= 0.045, "Sleeping advances the wall clock");
+  TEST_ASSERT(cpu < 0.03, "Sleeping does not use cpu time");
+
+  // Cpu time of the workers counts for the process, not for the caller
+  ImageSetThreads(4);
+  TEST_ASSERT(InstrThreads == 4, "ImageSetThreads sets the utilization base");
+  volatile uint64_t sink[8];
+  InstrReset();
+  PoolRun(8, BusyTask, (void*)sink);
+  double thread = thread_cpu_time() - InstrThreadTime;
+  cpu = cpu_time() - InstrTime;
+  TEST_ASSERT(thread <= cpu + 1e-3, "Caller cpu time is part of process cpu");
+  TEST_ASSERT(thread < cpu || ImageThreads() == 1 || PoolWorkers() == 0,
+              "Workers add cpu time beyond the caller's");
+  InstrPrint();
+  InstrPrintThreads();
+  ImageSetThreads(0);
+
+  TEST_END();
+}
+
 void test_edge_cases() {
   TEST_START("Edge Cases");
   
@@ -612,7 +1959,7 @@ void test_edge_cases() {
       InstrReset();
       int result = ImageIsEqual(img_same1, img_same2);
       printf("  Resultado: %s\n", result ? "IGUAIS" : "DIFERENTES");
-      printf("  Comparações: %lu pixels\n", InstrCount[0]);
+      printf("  Comparações: %lu pixels\n", InstrRead(0));
       printf("  Esperado: %u pixels\n\n", size * size);
     }
     ImageDestroy(&img_same1);
@@ -627,7 +1974,7 @@ void test_edge_cases() {
       InstrReset();
       int result = ImageIsEqual(img_diff1, img_diff2);
       printf("  Resultado: %s\n", result ? "IGUAIS" : "DIFERENTES");
-      printf("  Comparações: %lu pixels\n", InstrCount[0]);
+      printf("  Comparações: %lu pixels\n", InstrRead(0));
       printf("  Esperado: 1 pixel\n\n");
     }
     ImageDestroy(&img_diff1);
@@ -644,7 +1991,7 @@ void test_edge_cases() {
       InstrReset();
       int result = ImageIsEqual(img_pattern1, img_pattern2);
       printf("  Resultado: %s\n", result ? "IGUAIS" : "DIFERENTES");
-      printf("  Comparações: %lu pixels\n", InstrCount[0]);
+      printf("  Comparações: %lu pixels\n", InstrRead(0));
       printf("  Entre 1 e %u pixels\n\n", size * size);
     }
     ImageDestroy(&img_pattern1);
@@ -668,19 +2015,40 @@ int main(int argc, char* argv[]) {
   printf("╚════════════════════════════════════════════════╝\n");
 
   // Run comprehensive test suites
+  test_lazy_calibration();
   test_image_creation();
   test_image_copy();
   test_image_comparison();
   test_rotation_90();
   test_rotation_180();
+  test_rotation_d4();
   test_file_operations();
+  test_compact_lut();
+  test_label_histogram();
   test_region_filling_stack();
   test_region_filling_queue();
   test_region_filling_recursive();
+  test_recursive_depth_limit();
+  test_fill_context();
+  test_fill_connectivity_tolerance();
+  test_batch_fill();
+  test_parallel_fill();
   test_region_filling_consistency();
   test_fill_methods_performance();
   test_image_segmentation();
   test_segmentation_comparison();
+  test_segmentation_union_find();
+  test_segmentation_runs();
+  test_segmentation_stats();
+  test_incremental_segmentation();
+  test_streaming_segmentation();
+  test_region_adjacency();
+  test_region_contours();
+  test_morphology();
+  test_simd_kernels();
+  test_thread_pool();
+  test_thread_counters();
+  test_wall_time();
   test_edge_cases();
 
   printf("\n");
@@ -988,6 +2356,7 @@ int main(int argc, char* argv[]) {
   ImageDestroy(&image_1);
   ImageDestroy(&image_2);
   ImageDestroy(&image_3);
+  ImageShutdown();
 
   // Print comprehensive test summary
   printf("\n");
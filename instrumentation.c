@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional: the CTU is measured when first needed
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -17,15 +17,26 @@
 ///   InstrCount[1] += 1;  // to count addition
 ///   a[k] = a[i] + a[j];
 /// }
-/// InstrPrint();  // to show time and counters
+/// InstrPrint();  // to show times and counters
+/// InstrRead(0);  // to get the total of a counter
 
 #include "instrumentation.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Monotonic wall-clock time in seconds
+double wall_time(void) ; ///
+
+/// Cpu time of the calling thread in seconds
+double thread_cpu_time(void) ; ///
+
 #if defined(__linux__) || defined(__APPLE__)
 
 //
@@ -34,14 +45,27 @@ double cpu_time(void) ; ///
 
 #include <time.h>
 
-double cpu_time(void) {
+// Read a clock, in seconds (-1.0 on failure).
+static double clock_time(clockid_t clock) {
   struct timespec current_time;
 
-  if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &current_time) != 0)  // the first argument could also be CLOCK_REALTIME
+  if (clock_gettime(clock, &current_time) != 0)
     return -1.0; // clock_gettime() failed!!!
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double cpu_time(void) {
+  return clock_time(CLOCK_PROCESS_CPUTIME_ID);  // all threads of the process
+}
+
+double wall_time(void) {
+  return clock_time(CLOCK_MONOTONIC);  // not affected by clock adjustments
+}
+
+double thread_cpu_time(void) {
+  return clock_time(CLOCK_THREAD_CPUTIME_ID);  // the calling thread only
+}
+
 #endif
 
 
@@ -66,10 +90,106 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+double wall_time(void) {
+  return cpu_time();  // the performance counter is a monotonic wall clock
+}
+
+// Kernel plus user time of the calling thread
+double thread_cpu_time(void) {
+  FILETIME creation, exit, kernel, user;
+  if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+    return -1.0;
+  ULARGE_INTEGER k = {{kernel.dwLowDateTime, kernel.dwHighDateTime}};
+  ULARGE_INTEGER u = {{user.dwLowDateTime, user.dwHighDateTime}};
+  return 1.0e-7 * (double)(k.QuadPart + u.QuadPart);  // 100 ns units
+}
+
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Counter blocks
+//
+// Each thread gets its block of counters on its first count, linked in a
+// list so they can be aggregated. Blocks are cache-line aligned, so the
+// threads never write to the same line. When a thread ends, its counts
+// and cpu time are added to the retired block and its block is released.
+
+typedef struct instrBlock {
+  unsigned long count[NUMCOUNTERS];
+  double cpu;               // thread cpu_time at reset (retired: cpu used)
+#if defined(__linux__)
+  clockid_t clock;          // cpu clock of the thread, read by others
+#endif
+  int id;                   // registration order (0 is the first thread)
+  struct instrBlock* next;
+} __attribute__((aligned(64))) InstrBlock;
+
+static InstrBlock* instr_blocks = NULL;  // blocks of the running threads
+static InstrBlock instr_retired;         // counts of finished threads
+static int instr_nthreads = 0;           // threads registered so far
+static pthread_mutex_t instr_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t instr_key;
+static pthread_once_t instr_once = PTHREAD_ONCE_INIT;
+
+/// Counters of the calling thread (NULL until its first count)
+_Thread_local unsigned long* InstrThreadCount = NULL;  ///extern
+
+// Cpu time of the thread of a block (from any thread), or -1.0 if the
+// platform cannot read the clock of another thread.
+static double InstrBlockCPU(const InstrBlock* block) {
+#if defined(__linux__)
+  return clock_time(block->clock);
+#else
+  (void)block;
+  return -1.0;
+#endif
+}
+
+// Retire the block of a finishing thread.
+static void InstrRetire(void* p) {
+  InstrBlock* block = p;
+  pthread_mutex_lock(&instr_lock);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    instr_retired.count[i] += block->count[i];
+  if (block->cpu >= 0.0)
+    instr_retired.cpu += thread_cpu_time() - block->cpu;
+  InstrBlock** link = &instr_blocks;
+  while (*link != block) link = &(*link)->next;
+  *link = block->next;
+  pthread_mutex_unlock(&instr_lock);
+  free(block);
+}
+
+static void InstrCreateKey(void) {
+  if (pthread_key_create(&instr_key, InstrRetire) != 0) {
+    perror("pthread_key_create");
+    exit(255);
+  }
+}
+
+/// Register the calling thread and return its (zeroed) counters.
+unsigned long* InstrRegisterThread(void) { ///
+  pthread_once(&instr_once, InstrCreateKey);
+  InstrBlock* block = aligned_alloc(64, sizeof(InstrBlock));
+  if (block == NULL) {
+    perror("Alloc failed ->instrumentation");
+    exit(255);
+  }
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    block->count[i] = 0ul;
+#if defined(__linux__)
+  if (pthread_getcpuclockid(pthread_self(), &block->clock) != 0)
+    block->clock = CLOCK_THREAD_CPUTIME_ID;  // only valid for this thread
+#endif
+  block->cpu = thread_cpu_time();
+  pthread_mutex_lock(&instr_lock);
+  block->id = instr_nthreads++;
+  block->next = instr_blocks;
+  instr_blocks = block;
+  pthread_mutex_unlock(&instr_lock);
+  pthread_setspecific(instr_key, block);
+  InstrThreadCount = block->count;
+  return block->count;
+}
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
@@ -79,13 +199,138 @@ char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
 /// Cpu_time read on previous reset (~seconds)
 double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
+/// Wall_time read on previous reset (~seconds)
+double InstrWallTime;  ///extern
+
+/// Thread_cpu_time of the resetting thread on previous reset (~seconds)
+double InstrThreadTime;  ///extern
+
+/// Threads available to the measured code (for the cpu utilization)
+int InstrThreads = 1;  ///extern
+
+/// Calibrated Time Unit (in seconds, 1s until known)
 double InstrCTU = 1.0;  ///extern
 
-/// Find the Calibrated Time Unit (CTU).
-/// Run and time a loop of basic memory and arithmetic operations to set
-/// a reasonably cpu-independent time unit.
-void InstrCalibrate(void) { ///
+// Calibration takes a fraction of a second, so it only runs when the CTU
+// is first needed, and its result is kept in a small cache file, with
+// one "ctu model" line per CPU model, rewritten (not appended) when a
+// model is calibrated again.
+
+static int instr_ctu_known = 0;  // instr_ctu measured or loaded
+static double instr_ctu = 1.0;   // the measured or loaded CTU
+static pthread_mutex_t instr_ctu_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char instr_cpu_model[128] = "unknown";
+static pthread_once_t instr_cpu_once = PTHREAD_ONCE_INIT;
+
+static void InstrFindCPUModel(void) {
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL) return;
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* value = strchr(line, ':');
+    if (strncmp(line, "model name", 10) != 0 || value == NULL) continue;
+    value += strspn(value, ": \t");
+    value[strcspn(value, "\n")] = '\0';
+    if (value[0] != '\0')
+      snprintf(instr_cpu_model, sizeof(instr_cpu_model), "%s", value);
+    break;
+  }
+  fclose(f);
+}
+
+/// Model name of the CPU.
+const char* InstrCPUModel(void) { ///
+  pthread_once(&instr_cpu_once, InstrFindCPUModel);
+  return instr_cpu_model;
+}
+
+// Path of the cache file, or NULL if there is none.
+static const char* InstrCachePath(char path[], size_t size) {
+  const char* env = getenv("INSTR_CTU_CACHE");
+  if (env != NULL)
+    return env[0] != '\0' ? env : NULL;
+  const char* dir = getenv("XDG_CACHE_HOME");
+  if (dir != NULL && dir[0] != '\0') {
+    snprintf(path, size, "%s/instr_ctu", dir);
+    return path;
+  }
+  const char* home = getenv("HOME");
+  if (home == NULL || home[0] == '\0')
+    return NULL;
+  snprintf(path, size, "%s/.cache/instr_ctu", home);
+  return path;
+}
+
+// Cached CTU of this CPU model, or 0.0 if there is none.
+static double InstrLoadCTU(void) {
+  char buffer[512];
+  const char* path = InstrCachePath(buffer, sizeof(buffer));
+  FILE* f = path != NULL ? fopen(path, "r") : NULL;
+  if (f == NULL) return 0.0;
+  const char* model = InstrCPUModel();
+  double found = 0.0;
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* end;
+    double ctu = strtod(line, &end);
+    if (end == line || *end != ' ') continue;
+    end[1 + strcspn(end + 1, "\n")] = '\0';
+    if (ctu > 0.0 && strcmp(end + 1, model) == 0)
+      found = ctu;
+  }
+  fclose(f);
+  return found;
+}
+
+// Create the directories of path, like mkdir -p (errors are ignored:
+// they show up when the file is opened).
+static void InstrMakeDirs(const char* path) {
+  char dir[512];
+  snprintf(dir, sizeof(dir), "%s", path);
+  for (char* slash = strchr(dir + 1, '/'); slash != NULL;
+       slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    mkdir(dir, 0755);
+    *slash = '/';
+  }
+}
+
+// Save the CTU of this CPU model (silently skipped if not possible).
+// The lines of the other models are kept, and the new file replaces the
+// old one atomically, so concurrent processes never read a partial file.
+static void InstrSaveCTU(double ctu) {
+  char buffer[512];
+  const char* path = InstrCachePath(buffer, sizeof(buffer));
+  if (path == NULL) return;
+  InstrMakeDirs(path);
+
+  char tmp[600];
+  snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+  FILE* out = fopen(tmp, "w");
+  if (out == NULL) return;
+  const char* model = InstrCPUModel();
+  FILE* in = fopen(path, "r");
+  if (in != NULL) {
+    char line[256];
+    while (fgets(line, sizeof(line), in) != NULL) {
+      char* end;
+      strtod(line, &end);
+      if (end == line || *end != ' ') continue;  // not a cache line
+      size_t len = strcspn(end + 1, "\n");
+      if (len == strlen(model) && strncmp(end + 1, model, len) == 0)
+        continue;  // replaced below
+      fputs(line, out);
+    }
+    fclose(in);
+  }
+  fprintf(out, "%.9g %s\n", ctu, model);
+  if (fclose(out) != 0 || rename(tmp, path) != 0)
+    remove(tmp);
+}
+
+// Run and time the calibration loop.
+static double InstrMeasureCTU(void) {
   const int size = 4*1024;     // 2^12!
   const int mask = size - 1;
   int array[size];  // alloc array in stack, not initialized on purpose
@@ -98,32 +343,142 @@ void InstrCalibrate(void) { ///
     array[k] ^= array[i] + array[j] + i*j;
     //printf("%d %d %d\n", i, j, k);  // debug
   }
-  InstrCTU = cpu_time() - time;
+  return cpu_time() - time;
+}
+
+// CTU set by INSTR_CTU, or 0.0 if none.
+static double InstrEnvCTU(void) {
+  const char* env = getenv("INSTR_CTU");
+  if (env == NULL) return 0.0;
+  char* end;
+  double ctu = strtod(env, &end);
+  return end != env && ctu > 0.0 ? ctu : 0.0;
+}
+
+/// Find the Calibrated Time Unit (CTU).
+/// Run and time a loop of basic memory and arithmetic operations to set
+/// a reasonably cpu-independent time unit.
+void InstrCalibrate(void) { ///
+  double ctu = InstrEnvCTU();
+  if (ctu == 0.0) ctu = InstrMeasureCTU();
+  pthread_mutex_lock(&instr_ctu_lock);
+  InstrCTU = instr_ctu = ctu;
+  instr_ctu_known = 1;
+  InstrSaveCTU(ctu);
+  pthread_mutex_unlock(&instr_ctu_lock);
+}
+
+/// Get the CTU: from INSTR_CTU, the cache, or by calibrating once.
+double InstrGetCTU(void) { ///
+  double env_ctu = InstrEnvCTU();
+  if (env_ctu > 0.0) {
+    pthread_mutex_lock(&instr_ctu_lock);
+    InstrCTU = env_ctu;  // for readers of the global
+    pthread_mutex_unlock(&instr_ctu_lock);
+    return env_ctu;
+  }
+  pthread_mutex_lock(&instr_ctu_lock);
+  if (!instr_ctu_known) {
+    double ctu = InstrLoadCTU();
+    if (ctu == 0.0) {
+      ctu = InstrMeasureCTU();
+      InstrSaveCTU(ctu);
+    }
+    instr_ctu = ctu;
+    instr_ctu_known = 1;
+  }
+  double ctu = InstrCTU = instr_ctu;
+  pthread_mutex_unlock(&instr_ctu_lock);
+  return ctu;
 }
 
 /// Reset counters to zero and store cpu_time.
 void InstrReset(void) { ///
+  pthread_mutex_lock(&instr_lock);
+  for (InstrBlock* b = instr_blocks; b != NULL; b = b->next) {
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      b->count[i] = 0ul;
+    b->cpu = InstrBlockCPU(b);
+  }
   for (int i = 0; i < NUMCOUNTERS; i++)
-    InstrCount[i] = 0ul;
+    instr_retired.count[i] = 0ul;
+  instr_retired.cpu = 0.0;
+  pthread_mutex_unlock(&instr_lock);
+  InstrThreadTime = thread_cpu_time();
+  InstrWallTime = wall_time();
   InstrTime = cpu_time();
 }
 
+/// Total of counter i over all threads.
+unsigned long InstrRead(int i) { ///
+  unsigned long total = 0ul;
+  pthread_mutex_lock(&instr_lock);
+  for (InstrBlock* b = instr_blocks; b != NULL; b = b->next)
+    total += b->count[i];
+  total += instr_retired.count[i];
+  pthread_mutex_unlock(&instr_lock);
+  return total;
+}
+
 // Print times and all named counter values
 void InstrPrint(void) { ///
-  // elapsed time since last reset:
-  double time = cpu_time() - InstrTime;
+  // elapsed times since last reset:
+  double time = cpu_time() - InstrTime;  // all threads
+  double wall = wall_time() - InstrWallTime;
+  double thread = thread_cpu_time() - InstrThreadTime;  // this thread
   // compute time in calibrated time units:
-  double caltime = time / InstrCTU;
+  double caltime = time / InstrGetCTU();
+  // threads busy on average, and their share of the available ones
+  // (busy waiting counts as busy: this is not a speedup over a serial run)
+  double parallelism = wall > 0.0 ? time / wall : 0.0;
+  double utilization = parallelism / (InstrThreads > 0 ? InstrThreads : 1);
 
-  printf("#%14.15s\t%15.15s", "time", "caltime");
+  printf("#%14.15s\t%15.15s\t%15.15s\t%15.15s\t%15.15s\t%15.15s", "time",
+         "caltime", "wall", "thread", "parallelism", "utilization");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15.15s", InstrName[i]);
   puts("");
-  printf("%15.6f\t%15.6f", time, caltime);
+  printf("%15.6f\t%15.6f\t%15.6f\t%15.6f\t%15.3f\t%15.3f", time, caltime,
+         wall, thread, parallelism, utilization);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
+      printf("\t%15lu", InstrRead(i));  
   puts("");
 }
 
+// Print one row of counters, after the thread's cpu time
+static void InstrPrintRow(const char* name, int id, double cpu,
+                          const InstrBlock* b) {
+  if (id >= 0)
+    printf("%9.9s %5d", name, id);
+  else
+    printf("%15.15s", name);
+  if (cpu >= 0.0)
+    printf("\t%15.6f", cpu);
+  else
+    printf("\t%15s", "-");
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    if (InstrName[i] != NULL)
+      printf("\t%15lu", b->count[i]);
+  puts("");
+}
+
+// Print the cpu time and named counters of each thread
+void InstrPrintThreads(void) { ///
+  printf("#%14.14s\t%15.15s", "thread", "cpu");
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    if (InstrName[i] != NULL)
+      printf("\t%15.15s", InstrName[i]);
+  puts("");
+  pthread_mutex_lock(&instr_lock);
+  // The list is newest first: print in registration order
+  for (int id = 0; id < instr_nthreads; id++)
+    for (InstrBlock* b = instr_blocks; b != NULL; b = b->next)
+      if (b->id == id) {
+        double now = InstrBlockCPU(b);
+        InstrPrintRow("thread", id, now >= 0.0 ? now - b->cpu : -1.0, b);
+      }
+  InstrPrintRow("finished", -1, instr_retired.cpu, &instr_retired);
+  pthread_mutex_unlock(&instr_lock);
+}
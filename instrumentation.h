@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional: the CTU is measured when first needed
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -17,19 +17,39 @@
 ///   InstrCount[1] += 1;  // to count addition
 ///   a[k] = a[i] + a[j];
 /// }
-/// InstrPrint();  // to show time and counters
+/// InstrPrint();  // to show times and counters
+/// InstrRead(0);  // to get the total of a counter
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
-/// Cpu time in seconds
+#include <stddef.h>
+
+/// Cpu time in seconds (of all the threads of the process)
 double cpu_time(void) ; ///
 
+/// Monotonic wall-clock time in seconds (includes waiting, e.g. for I/O)
+double wall_time(void) ; ///
+
+/// Cpu time of the calling thread in seconds
+double thread_cpu_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Counter blocks of the threads (private, see InstrCount)
+extern _Thread_local unsigned long* InstrThreadCount;  ///extern
+unsigned long* InstrRegisterThread(void) ;
+
+static inline unsigned long* InstrThreadCounters(void) {
+  unsigned long* count = InstrThreadCount;
+  return count != NULL ? count : InstrRegisterThread();
+}
+
+/// Array of operation counters of the calling thread:
+/// Each thread increments its own block of counters, with no atomics and
+/// no shared cache lines. Use InstrRead to get the totals of all threads.
+#define InstrCount (InstrThreadCounters())
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
@@ -37,18 +57,57 @@ extern char* InstrName[NUMCOUNTERS];  ///extern
 /// Cpu_time read on previous reset (~seconds)
 extern double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
+/// Wall_time read on previous reset (~seconds)
+extern double InstrWallTime;  ///extern
+
+/// Thread_cpu_time of the resetting thread on previous reset (~seconds)
+extern double InstrThreadTime;  ///extern
+
+/// Threads available to the measured code (1 by default).
+/// InstrPrint reports the cpu utilization relative to it.
+extern int InstrThreads;  ///extern
+
+/// Calibrated Time Unit (in seconds, 1s until known; see InstrGetCTU)
 extern double InstrCTU;  ///extern
 
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
+/// If INSTR_CTU is set (see InstrGetCTU), its value is taken instead,
+/// without running the loop.
+/// The result is saved in the CTU cache file.
 void InstrCalibrate(void) ;
 
+/// Get the CTU, calibrating on the first call if needed.
+/// The environment variable INSTR_CTU (in seconds) overrides it.
+/// Otherwise, a CTU saved for this CPU model in the cache file is used,
+/// and only if there is none InstrCalibrate is called.
+/// The cache file is INSTR_CTU_CACHE if set (empty: no cache), else
+/// $XDG_CACHE_HOME/instr_ctu or ~/.cache/instr_ctu.
+double InstrGetCTU(void) ;
+
+/// Model name of the CPU, the key of the CTU cache.
+const char* InstrCPUModel(void) ;
+
 /// Reset counters to zero and store cpu_time.
+/// (Counters of all threads; call when no instrumented code is running.)
 void InstrReset(void) ;
 
+/// Total of counter i over all threads (including finished ones).
+/// Exact when no instrumented code is running.
+unsigned long InstrRead(int i) ;
+
+/// Print times and the totals of all named counters.
+/// Times since the reset: process cpu time (and in CTUs), wall time and
+/// cpu time of the calling thread; parallelism is cpu time over wall time
+/// (threads busy on average, busy waiting included) and utilization is
+/// parallelism over InstrThreads. Neither is a speedup: for that, compare
+/// the wall times of a parallel and a serial run.
 void InstrPrint(void) ;
 
+/// Print the cpu time since the reset and the named counters of each
+/// thread. (Cpu times of running threads need Linux.)
+void InstrPrintThreads(void) ;
+
 #endif
 
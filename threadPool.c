@@ -0,0 +1,283 @@
+/// threadPool - A small work-stealing thread pool
+///
+/// This module is part of a programming project for the course
+/// AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+///
+/// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+/// 2025
+
+#include "threadPool.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "instrumentation.h"
+
+// Check a condition and if false, print failmsg and exit.
+static void check(int condition, const char* failmsg) {
+  if (!condition) {
+    perror(failmsg);
+    exit(errno || 255);
+  }
+}
+
+// A pending task
+typedef struct {
+  TaskFunction fn;
+  void* arg;
+  int task;
+  TaskGroup* group;
+} PoolTask;
+
+// A deque of tasks: a ring buffer holding items [top, bottom).
+// The owner pushes and pops at the bottom, thieves steal at the top.
+// Tasks are coarse (bands of rows), so a lock per deque is cheap enough.
+struct deque {
+  PoolTask* items;
+  size_t top, bottom;  // increasing; the slot of item i is i % capacity
+  size_t capacity;
+  pthread_mutex_t lock;
+};
+
+static struct {
+  int nworkers;
+  pthread_t* threads;
+  struct deque* deques;  // one per worker, plus the injection deque
+  atomic_long queued;    // tasks in the deques
+  int stop;              // protected by lock
+  pthread_mutex_t lock;  // protects the sleep of idle workers
+  pthread_cond_t wake;
+} pool = {0, NULL, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER,
+          PTHREAD_COND_INITIALIZER};
+
+// Longest sleep of a worker waiting for a group, before it looks for
+// tasks again (1 ms)
+#define WORKER_WAIT_NS 1000000L
+
+// Index of the deque of the current thread's worker, or -1 for clients
+static _Thread_local int worker_id = -1;
+
+static void DequeInit(struct deque* d) {
+  d->capacity = 64;
+  d->items = malloc(d->capacity * sizeof(PoolTask));
+  check(d->items != NULL, "Alloc failed ->deque");
+  d->top = d->bottom = 0;
+  pthread_mutex_init(&d->lock, NULL);
+}
+
+static void DequeDestroy(struct deque* d) {
+  assert(d->top == d->bottom);
+  pthread_mutex_destroy(&d->lock);
+  free(d->items);
+}
+
+static void DequePush(struct deque* d, PoolTask t) {
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom - d->top == d->capacity) {
+    size_t capacity = 2 * d->capacity;
+    PoolTask* items = malloc(capacity * sizeof(PoolTask));
+    check(items != NULL, "Alloc failed ->deque");
+    for (size_t i = d->top; i < d->bottom; i++) {
+      items[i % capacity] = d->items[i % d->capacity];
+    }
+    free(d->items);
+    d->items = items;
+    d->capacity = capacity;
+  }
+  d->items[d->bottom++ % d->capacity] = t;
+  pthread_mutex_unlock(&d->lock);
+}
+
+// Take a task from the bottom (owner) or from the top (thief).
+// Returns 0 if the deque is empty.
+static int DequeTake(struct deque* d, PoolTask* t, int steal) {
+  int found = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom > d->top) {
+    *t = steal ? d->items[d->top++ % d->capacity]
+               : d->items[--d->bottom % d->capacity];
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+// Find a pending task: from the own deque first, then from the others.
+static int FindTask(PoolTask* t) {
+  int n = pool.nworkers + 1;
+  int self = worker_id >= 0 ? worker_id : pool.nworkers;
+  if (atomic_load(&pool.queued) <= 0) return 0;
+  if (DequeTake(&pool.deques[self], t, 0)) goto found;
+  for (int k = 1; k < n; k++) {
+    if (DequeTake(&pool.deques[(self + k) % n], t, 1)) goto found;
+  }
+  return 0;
+found:
+  atomic_fetch_sub(&pool.queued, 1);
+  return 1;
+}
+
+static void RunTask(PoolTask* t) {
+  t->fn(t->arg, t->task);
+  // The lock is held while signaling, so the waiter cannot release the
+  // group before this thread is done with it.
+  TaskGroup* g = t->group;
+  pthread_mutex_lock(&g->lock);
+  if (atomic_fetch_sub(&g->pending, 1) == 1) {
+    pthread_cond_broadcast(&g->done);
+  }
+  pthread_mutex_unlock(&g->lock);
+}
+
+static void* WorkerMain(void* p) {
+  worker_id = (int)(intptr_t)p;
+  InstrThreadCounters();  // so its cpu time shows in InstrPrintThreads
+  for (;;) {
+    PoolTask t;
+    if (FindTask(&t)) {
+      RunTask(&t);
+      continue;
+    }
+    pthread_mutex_lock(&pool.lock);
+    while (atomic_load(&pool.queued) <= 0 && !pool.stop) {
+      pthread_cond_wait(&pool.wake, &pool.lock);
+    }
+    int stop = pool.stop && atomic_load(&pool.queued) <= 0;
+    pthread_mutex_unlock(&pool.lock);
+    if (stop) break;
+  }
+  return NULL;
+}
+
+void PoolInit(int nworkers) {
+  assert(nworkers >= 0);
+  PoolShutdown();
+  if (nworkers == 0) return;
+
+  pool.deques = malloc((nworkers + 1) * sizeof(struct deque));
+  pool.threads = malloc(nworkers * sizeof(pthread_t));
+  check(pool.deques != NULL && pool.threads != NULL, "Alloc failed ->pool");
+  for (int k = 0; k <= nworkers; k++) DequeInit(&pool.deques[k]);
+  atomic_store(&pool.queued, 0);
+  pool.stop = 0;
+  pool.nworkers = nworkers;
+  for (int k = 0; k < nworkers; k++) {
+    check(pthread_create(&pool.threads[k], NULL, WorkerMain,
+                         (void*)(intptr_t)k) == 0,
+          "pthread_create");
+  }
+}
+
+void PoolShutdown(void) {
+  if (pool.nworkers == 0) return;
+  assert(worker_id < 0);  // not from a task
+
+  pthread_mutex_lock(&pool.lock);
+  pool.stop = 1;
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+  for (int k = 0; k < pool.nworkers; k++) {
+    pthread_join(pool.threads[k], NULL);
+  }
+  for (int k = 0; k <= pool.nworkers; k++) DequeDestroy(&pool.deques[k]);
+  free(pool.deques);
+  free(pool.threads);
+  pool.deques = NULL;
+  pool.threads = NULL;
+  pool.nworkers = 0;
+}
+
+int PoolWorkers(void) { return pool.nworkers; }
+
+void PoolGroupInit(TaskGroup* group) {
+  assert(group != NULL);
+  atomic_init(&group->pending, 0);
+  pthread_mutex_init(&group->lock, NULL);
+  pthread_cond_init(&group->done, NULL);
+}
+
+void PoolGroupDestroy(TaskGroup* group) {
+  assert(group != NULL);
+  assert(atomic_load(&group->pending) == 0);
+  pthread_cond_destroy(&group->done);
+  pthread_mutex_destroy(&group->lock);
+}
+
+void PoolSpawn(TaskGroup* group, TaskFunction fn, void* arg, int task) {
+  assert(group != NULL);
+  if (pool.nworkers == 0) {
+    fn(arg, task);
+    return;
+  }
+
+  atomic_fetch_add(&group->pending, 1);
+  PoolTask t = {fn, arg, task, group};
+  // Counted before it is visible, so no worker goes to sleep with it queued
+  atomic_fetch_add(&pool.queued, 1);
+  int self = worker_id >= 0 ? worker_id : pool.nworkers;
+  DequePush(&pool.deques[self], t);
+
+  pthread_mutex_lock(&pool.lock);
+  pthread_cond_signal(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+void PoolWait(TaskGroup* group) {
+  assert(group != NULL);
+  while (atomic_load(&group->pending) > 0) {
+    PoolTask t;
+    if (FindTask(&t)) {
+      RunTask(&t);
+    } else if (worker_id >= 0) {
+      // A worker sleeps until the group is done, but wakes up now and then
+      // to run tasks queued meanwhile (the other workers may be waiting
+      // too, so nobody else may run them)
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += WORKER_WAIT_NS;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      pthread_mutex_lock(&group->lock);
+      if (atomic_load(&group->pending) > 0) {
+        pthread_cond_timedwait(&group->done, &group->lock, &deadline);
+      }
+      pthread_mutex_unlock(&group->lock);
+    } else {
+      // A client sleeps: the workers run the remaining tasks
+      pthread_mutex_lock(&group->lock);
+      while (atomic_load(&group->pending) > 0) {
+        pthread_cond_wait(&group->done, &group->lock);
+      }
+      pthread_mutex_unlock(&group->lock);
+    }
+  }
+  // Wait for the last RunTask to release the group
+  pthread_mutex_lock(&group->lock);
+  pthread_mutex_unlock(&group->lock);
+}
+
+void PoolRun(int ntasks, TaskFunction fn, void* arg) {
+  assert(ntasks > 0);
+  if (ntasks == 1 || pool.nworkers == 0) {
+    for (int t = 0; t < ntasks; t++) fn(arg, t);
+    return;
+  }
+
+  TaskGroup group;
+  PoolGroupInit(&group);
+  for (int t = ntasks - 1; t >= 1; t--) {
+    PoolSpawn(&group, fn, arg, t);
+  }
+  fn(arg, 0);
+  PoolWait(&group);
+  PoolGroupDestroy(&group);
+}
@@ -0,0 +1,75 @@
+/// threadPool - A small work-stealing thread pool
+///
+/// The parallel operations of imageRGB submit their tasks to a pool of
+/// worker threads. Each worker owns a deque of tasks: it pushes and pops
+/// its own tasks at the bottom (LIFO, cache friendly), and idle workers
+/// steal from the top of the other deques (FIFO, the oldest and usually
+/// largest tasks). Threads that are not workers submit to a shared
+/// injection deque.
+///
+/// Tasks are grouped: PoolSpawn adds a task to a group and PoolWait waits
+/// for all the tasks of the group, running pending tasks meanwhile.
+/// Tasks may spawn more tasks and wait for them, so fork-join task graphs
+/// are supported as well as range-parallel loops (PoolRun).
+///
+/// Without workers (none started, or zero requested), tasks run serially
+/// on the calling thread.
+///
+/// Several client threads may use the pool concurrently.
+///
+/// This module is part of a programming project for the course
+/// AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+///
+/// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+/// 2025
+
+#ifndef _THREAD_POOL_
+#define _THREAD_POOL_
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+/// A task: fn(arg, task)
+typedef void (*TaskFunction)(void* arg, int task);
+
+/// A group of tasks, waited for together.
+/// (Fields are private; initialize with PoolGroupInit.)
+typedef struct {
+  atomic_int pending;    // spawned tasks not yet finished
+  pthread_mutex_t lock;  // protects the wake up of the waiter
+  pthread_cond_t done;
+} TaskGroup;
+
+/// Start the pool with nworkers worker threads (0 = serial execution).
+/// A running pool is stopped first.
+/// Must not be called while tasks are pending.
+void PoolInit(int nworkers);
+
+/// Stop the worker threads and release the pool.
+/// Must not be called while tasks are pending.
+void PoolShutdown(void);
+
+/// Number of worker threads of the pool (0 if serial).
+int PoolWorkers(void);
+
+/// Initialize an empty group of tasks.
+void PoolGroupInit(TaskGroup* group);
+
+/// Release a group (after PoolWait).
+void PoolGroupDestroy(TaskGroup* group);
+
+/// Add the task fn(arg, task) to group.
+/// Without workers, the task runs immediately.
+void PoolSpawn(TaskGroup* group, TaskFunction fn, void* arg, int task);
+
+/// Wait for all the tasks of group, running pending tasks meanwhile.
+void PoolWait(TaskGroup* group);
+
+/// Run fn(arg, 0), ..., fn(arg, ntasks-1) and wait for all.
+/// Task 0 runs on the calling thread.
+void PoolRun(int ntasks, TaskFunction fn, void* arg);
+
+#endif  // _THREAD_POOL_